@@ -0,0 +1,166 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cbbl {
+// z (5 bits), x and y (21 bits each, enough for z21) and scale (2 bits) in one integer;
+// the low 15 bits are left free.
+inline uint64_t packTile(int z, int x, int y, int scale) {
+    return ((uint64_t)z << 59) | ((uint64_t)x << 38) | ((uint64_t)y << 17) | ((uint64_t)scale << 15);
+}
+
+inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct CacheKey {
+    uint64_t tile;
+    int version;
+
+    bool operator==(const CacheKey &o) const { return tile == o.tile && version == o.version; }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey &k) const { return mix64(k.tile ^ ((uint64_t)k.version << 1)); }
+};
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+    uint64_t max_bytes = 0;
+};
+
+// Byte-bounded LRU, split into independently locked shards so concurrent
+// lookups rarely contend. Values are immutable and handed out as shared_ptr,
+// so a hit never copies the payload while holding a lock.
+template <typename V>
+class LruCache {
+    public:
+    LruCache(size_t max_bytes, int num_shards = 16) : mMaxBytes(max_bytes), mShardBytes(max_bytes / num_shards) {
+        for (int i = 0; i < num_shards; i++) mShards.push_back(std::make_unique<Shard>());
+    }
+
+    bool enabled() const { return mMaxBytes > 0; }
+
+    std::shared_ptr<const V> get(const CacheKey &key) {
+        if (!enabled()) return nullptr;
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            mMisses++;
+            return nullptr;
+        }
+        shard.lru.splice(shard.lru.begin(),shard.lru,it->second);
+        mHits++;
+        return it->second->value;
+    }
+
+    void put(const CacheKey &key, std::shared_ptr<const V> value, size_t bytes) {
+        if (!enabled() || bytes > mShardBytes) return;
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            shard.bytes -= it->second->bytes;
+            shard.lru.erase(it->second);
+            shard.index.erase(it);
+        }
+        shard.lru.push_front(Entry{key,std::move(value),bytes});
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += bytes;
+        while (shard.bytes > mShardBytes) {
+            auto &last = shard.lru.back();
+            shard.bytes -= last.bytes;
+            shard.index.erase(last.key);
+            shard.lru.pop_back();
+            mEvictions++;
+        }
+    }
+
+    CacheStats stats() {
+        CacheStats s;
+        s.hits = mHits;
+        s.misses = mMisses;
+        s.evictions = mEvictions;
+        s.max_bytes = mMaxBytes;
+        for (auto &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            s.entries += shard->index.size();
+            s.bytes += shard->bytes;
+        }
+        return s;
+    }
+
+    private:
+    struct Entry {
+        CacheKey key;
+        std::shared_ptr<const V> value;
+        size_t bytes;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // most recently used first
+        std::unordered_map<CacheKey,typename std::list<Entry>::iterator,CacheKeyHash> index;
+        size_t bytes = 0;
+    };
+
+    Shard &shardFor(const CacheKey &key) {
+        return *mShards[CacheKeyHash()(key) % mShards.size()];
+    }
+
+    size_t mMaxBytes;
+    size_t mShardBytes;
+    std::vector<std::unique_ptr<Shard>> mShards;
+    std::atomic<uint64_t> mHits{0};
+    std::atomic<uint64_t> mMisses{0};
+    std::atomic<uint64_t> mEvictions{0};
+};
+
+// encoded display tiles; the key is the display tile and the style version
+using TileCache = LruCache<std::string>;
+
+// Rendered metatiles persisted under a directory, one file per metatile
+// holding all of its encoded display tiles behind a small offset index.
+// Reads mmap the file and copy out only the requested tile. Files are
+// evicted least-recently-used first once the total exceeds max_bytes;
+// existing files are picked up again at startup.
+class DiskCache {
+    public:
+    // throws if dir exists, is not empty and was not created as a disk cache
+    DiskCache(const std::string &dir, size_t max_bytes);
+    // path is relative to the cache directory; index is the display tile's position in the metatile
+    std::shared_ptr<const std::string> get(const std::string &path, int index);
+    void put(const std::string &path, const std::vector<std::shared_ptr<const std::string>> &tiles);
+    CacheStats stats();
+
+    private:
+    void touch(const std::string &path, size_t bytes);
+    void evict();
+
+    std::string mDir;
+    size_t mMaxBytes;
+    std::mutex mMutex;
+    std::list<std::string> mLru; // most recently used first
+    std::unordered_map<std::string,std::pair<std::list<std::string>::iterator,size_t>> mIndex;
+    size_t mBytes = 0;
+    std::atomic<uint64_t> mHits{0};
+    std::atomic<uint64_t> mMisses{0};
+    std::atomic<uint64_t> mEvictions{0};
+};
+}
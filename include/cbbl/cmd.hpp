@@ -1,3 +1,5 @@
 #pragma once
 void cmdServe(int argc, char* argv[]);
 void cmdBatch(int argc, char* argv[]);
+void cmdBench(int argc, char* argv[]);
+void cmdLoadtest(int argc, char* argv[]);
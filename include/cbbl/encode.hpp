@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+#include "mapnik/image_view.hpp"
+
+namespace cbbl {
+// An output image format, given as a Mapnik format string, e.g.
+// png, png8 (palette), png8:z=9 (zlib level), jpeg85, webp:quality=80
+class Encoder {
+    public:
+    // throws if Mapnik cannot encode the format
+    Encoder(const std::string &format = "png");
+
+    const std::string &format() const { return mFormat; }
+    // file extension and mbtiles format: png, jpg or webp
+    const std::string &extension() const { return mExtension; }
+    const std::string &contentType() const { return mContentType; }
+    std::string encode(const mapnik::image_view_rgba8 &img) const;
+
+    private:
+    std::string mFormat;
+    std::string mExtension;
+    std::string mContentType;
+};
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace cbbl {
+// MurmurHash64A: fast, non-cryptographic 64-bit hash of a byte range.
+inline uint64_t hashBytes(const char *data, size_t len, uint64_t seed = 0) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+
+    const char *end = data + (len / 8) * 8;
+    for (const char *p = data; p != end; p += 8) {
+        uint64_t k;
+        memcpy(&k,p,8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char *tail = (const unsigned char *)end;
+    switch (len & 7) {
+        case 7: h ^= uint64_t(tail[6]) << 48;
+        case 6: h ^= uint64_t(tail[5]) << 40;
+        case 5: h ^= uint64_t(tail[4]) << 32;
+        case 4: h ^= uint64_t(tail[3]) << 24;
+        case 3: h ^= uint64_t(tail[2]) << 16;
+        case 2: h ^= uint64_t(tail[1]) << 8;
+        case 1: h ^= uint64_t(tail[0]);
+                h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+inline uint64_t hashBytes(const std::string &s, uint64_t seed = 0) {
+    return hashBytes(s.data(),s.size(),seed);
+}
+
+inline std::string toHex(uint64_t h) {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(16,'0');
+    for (int i = 15; i >= 0; i--) {
+        s[i] = digits[h & 0xf];
+        h >>= 4;
+    }
+    return s;
+}
+}
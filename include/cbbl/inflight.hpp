@@ -0,0 +1,92 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "cbbl/cache.hpp"
+
+namespace cbbl {
+// Callers waiting on jobs that are running, keyed like the caches. Split into
+// independently locked hash shards, so requests for different tiles don't
+// contend and a lookup is one hash probe. The first caller to join a key
+// starts the job; whoever finishes it takes all waiters out at once.
+template <typename W>
+class InFlight {
+    public:
+    InFlight(int num_shards = 64) {
+        for (int i = 0; i < num_shards; i++) mShards.push_back(std::make_unique<Shard>());
+    }
+
+    // adds w to the waiters of key; true if it is the first, so the caller starts the job
+    bool join(const CacheKey &key, W w) {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto &waiters = shard.jobs[key];
+        waiters.push_back(std::move(w));
+        return waiters.size() == 1;
+    }
+
+    bool contains(const CacheKey &key) {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.jobs.count(key) > 0;
+    }
+
+    // removes key and moves out its waiters
+    std::vector<W> take(const CacheKey &key) {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        std::vector<W> waiters;
+        auto it = shard.jobs.find(key);
+        if (it == shard.jobs.end()) return waiters;
+        waiters = std::move(it->second);
+        shard.jobs.erase(it);
+        return waiters;
+    }
+
+    // calls f on the waiters of key with its shard locked; if f leaves none, key is removed
+    // and false returned. f must not call back into this InFlight.
+    template <typename F>
+    bool update(const CacheKey &key, F f) {
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.jobs.find(key);
+        if (it == shard.jobs.end()) return false;
+        f(it->second);
+        if (!it->second.empty()) return true;
+        shard.jobs.erase(it);
+        return false;
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (auto &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            n += shard->jobs.size();
+        }
+        return n;
+    }
+
+    // calls f(key, waiters) for every job, locking one shard at a time
+    template <typename F>
+    void forEach(F f) {
+        for (auto &shard : mShards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (auto const &job : shard->jobs) f(job.first,job.second);
+        }
+    }
+
+    private:
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<CacheKey,std::vector<W>,CacheKeyHash> jobs;
+    };
+
+    Shard &shardFor(const CacheKey &key) {
+        return *mShards[CacheKeyHash()(key) % mShards.size()];
+    }
+
+    std::vector<std::unique_ptr<Shard>> mShards;
+};
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace cbbl {
+struct RenderTiming;
+
+// Latency histogram with fixed buckets from 0.1 ms to 10 s. Observing is a
+// few relaxed atomic adds, so it is cheap enough to call from every thread.
+class Histogram {
+    public:
+    static const int BUCKETS = 16;
+    // upper bounds in ms; one more bucket past the last holds everything slower
+    static const std::array<double,BUCKETS> &bounds();
+
+    void observe(double ms);
+    uint64_t count() const { return mCount; }
+    double sumMs() const { return mSumMicros / 1000.0; }
+    // estimated by interpolating inside the bucket the quantile falls in
+    double quantileMs(double q) const;
+    // cumulative buckets in seconds, as prometheus expects them
+    void writePrometheus(std::ostream &out, const std::string &name, const std::string &labels) const;
+    // {"count":..,"sum_s":..,"mean_ms":..,"p50_ms":..,"p95_ms":..,"p99_ms":..}
+    void writeJson(std::ostream &out) const;
+
+    private:
+    std::array<std::atomic<uint64_t>,BUCKETS + 1> mBuckets{};
+    std::atomic<uint64_t> mCount{0};
+    std::atomic<uint64_t> mSumMicros{0};
+};
+
+// one histogram per step a tile goes through from source to client
+struct StageMetrics {
+    Histogram fetch;      // reading the compressed tile from the source
+    Histogram decompress; // gunzipping it
+    Histogram datasource; // decoding vector tile layers into datasources
+    Histogram setup;      // attaching layers to the prepared Map
+    Histogram render;     // agg rasterization
+    Histogram encode;     // encoding all display tiles of a metatile
+    Histogram write;      // handing the encoded tiles to the sink or the clients
+
+    void add(const RenderTiming &timing);
+    // cbbl_stage_seconds{stage="..."}
+    void writePrometheus(std::ostream &out) const;
+    // {"fetch":{...},"decompress":{...},...}
+    void writeJson(std::ostream &out) const;
+};
+
+// nearest rank, over values sorted ascending
+inline double percentile(const std::vector<double> &sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)std::ceil(q * sorted.size());
+    return sorted[std::min(std::max(rank,(size_t)1),sorted.size()) - 1];
+}
+
+inline double elapsedMs(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t).count() / 1000.0;
+}
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace cbbl {
+// Bounded lock-free queue for any number of producers and consumers, after
+// Dmitry Vyukov's array-based design: each cell carries a sequence number
+// that tells producers and consumers whether it is free or filled.
+// push() and pop() wait while the queue is full or empty, so a slow consumer
+// throttles its producers instead of letting the queue grow. They spin briefly,
+// then sleep on a condition variable that the other side signals only when
+// someone is asleep, so the fast path takes no lock.
+template <typename T>
+class BoundedQueue {
+    public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        mMask = size - 1;
+        mCells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++) mCells[i].sequence.store(i,std::memory_order_relaxed);
+    }
+
+    bool tryPush(T &value) {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = mCells[pos & mMask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (mEnqueuePos.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)) {
+                    cell.data = std::move(value);
+                    cell.sequence.store(pos + 1,std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T &value) {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = mCells[pos & mMask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (mDequeuePos.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)) {
+                    value = std::move(cell.data);
+                    cell.sequence.store(pos + mMask + 1,std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                pos = mDequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void push(T value) {
+        int spins = 0;
+        while (!tryPush(value)) {
+            if (++spins < SPINS) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mMutex);
+            mSleepingPushers++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            mNotFull.wait(lock,[this] { return size() < capacity(); });
+            mSleepingPushers--;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mSleepingPoppers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mNotEmpty.notify_one();
+        }
+    }
+
+    // waits for an item; gives up and returns false once done() is true and the queue is empty.
+    // Whoever makes done() true must then call wake().
+    template <typename Done>
+    bool pop(T &value, Done done) {
+        int spins = 0;
+        while (!tryPop(value)) {
+            if (done()) {
+                if (!tryPop(value)) return false;
+                break;
+            }
+            if (++spins < SPINS) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mMutex);
+            mSleepingPoppers++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            mNotEmpty.wait(lock,[&] { return size() > 0 || done(); });
+            mSleepingPoppers--;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mSleepingPushers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mNotFull.notify_one();
+        }
+        return true;
+    }
+
+    // wakes every waiting pop() to check its done() again
+    void wake() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mNotEmpty.notify_all();
+    }
+
+    size_t size() const {
+        size_t enq = mEnqueuePos.load(std::memory_order_relaxed);
+        size_t deq = mDequeuePos.load(std::memory_order_relaxed);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    size_t capacity() const { return mMask + 1; }
+
+    private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    static const int SPINS = 64;
+
+    std::unique_ptr<Cell[]> mCells;
+    size_t mMask;
+    alignas(64) std::atomic<size_t> mEnqueuePos{0};
+    alignas(64) std::atomic<size_t> mDequeuePos{0};
+    // the slow path: threads asleep on a full or empty queue
+    std::mutex mMutex;
+    std::condition_variable mNotFull;
+    std::condition_variable mNotEmpty;
+    std::atomic<int> mSleepingPushers{0};
+    std::atomic<int> mSleepingPoppers{0};
+};
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace cbbl {
+// Thread pool where every worker owns a deque of tasks. A task posted from a
+// worker goes on that worker's own deque and is run newest-first, keeping its
+// data hot in cache; a worker that runs out steals the oldest task from
+// another, so one large posted subtree is spread over all threads.
+class WorkStealingPool {
+    public:
+    WorkStealingPool(int threads);
+    ~WorkStealingPool();
+    void post(std::function<void()> task);
+    // waits until every task, including tasks posted by tasks, has run, then stops the workers
+    void join();
+    size_t pending() const { return mPending; }
+
+    private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void run(int index);
+    bool take(int index, std::function<void()> &task);
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::vector<std::thread> mThreads;
+    std::atomic<size_t> mQueued{0};  // in some deque
+    std::atomic<size_t> mPending{0}; // posted and not yet finished
+    std::atomic<size_t> mNext{0};
+    std::atomic<bool> mStop{false};
+    std::mutex mSleepMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+};
+
+// Thread pool that always runs the queued task with the highest priority next;
+// tasks of equal priority run in the order they were posted.
+class PriorityPool {
+    public:
+    PriorityPool(int threads);
+    ~PriorityPool();
+    void post(std::function<void()> task, int64_t priority);
+    // waits until every task has run, then stops the workers
+    void join();
+    // tasks waiting for a thread
+    size_t queued();
+    // tasks being run right now
+    size_t running();
+    // summed over all threads; its rate divided by the thread count is the utilisation
+    double busySeconds() const { return mBusyMicros / 1e6; }
+    int threads() const { return mThreads.size(); }
+
+    private:
+    struct Task {
+        int64_t priority;
+        uint64_t sequence;
+        std::function<void()> run;
+
+        bool operator<(const Task &o) const {
+            if (priority != o.priority) return priority < o.priority;
+            return sequence > o.sequence;
+        }
+    };
+
+    void run();
+
+    std::vector<std::thread> mThreads;
+    std::priority_queue<Task> mTasks;
+    uint64_t mSequence = 0;
+    size_t mRunning = 0;
+    std::atomic<uint64_t> mBusyMicros{0};
+    bool mStop = false;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+};
+}
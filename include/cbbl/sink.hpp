@@ -2,41 +2,125 @@
 #include <string>
 #include <memory>
 #include <set>
+#include <map>
+#include <tuple>
+#include <vector>
+#include <fstream>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <unordered_set>
 #include <sqlite3.h>
+#include "cbbl/queue.hpp"
 
 namespace cbbl {
+struct SinkOptions {
+    // files: extension of written tiles
+    std::string extension = "png";
+    // mbtiles: store each distinct image once, in the map/images layout
+    bool dedup = false;
+    // mbtiles: tiles per committed transaction
+    int commit_size = 1000;
+    // mbtiles: tiles waiting for the writer thread before writeTile blocks
+    int queue_size = 4096;
+    // update an existing output in place: written tiles replace existing ones
+    bool append = false;
+    // keep the progress of an interrupted run instead of starting a new record
+    bool resume = false;
+    // mbtiles: also commit when this many seconds have passed since the last commit
+    int commit_seconds = 10;
+};
+
 class Sink {
     public:
-    virtual void writeTile(int res, int z, int x, int y, const std::string& buf) = 0;
+    // buf is shared rather than copied, so a sink may hold on to it until it is written
+    virtual void writeTile(int res, int z, int x, int y, std::shared_ptr<const std::string> buf) = 0;
+    virtual void deleteTile(int res, int z, int x, int y) { };
+    // records that every display tile of source tile z/x/y has been written
+    virtual void writeProgress(int z, int x, int y) { };
+    // source tiles recorded by writeProgress, in this output's current run
+    virtual std::vector<std::tuple<int,int,int>> readProgress() { return {}; };
+    // called once every tile is written: removes the progress record, which only an interrupted run keeps
+    virtual void finish() { };
     virtual void writeMetadata(const std::map<std::string,std::string>& metadata) { };
     virtual ~Sink() {};
 };
 
-std::unique_ptr<Sink> CreateSink(const std::string &s);
+std::unique_ptr<Sink> CreateSink(const std::string &s, const SinkOptions &options = SinkOptions());
 
 class FileSink : public Sink {
     public:
-    FileSink(const std::string &path);
+    FileSink(const std::string &path, const SinkOptions &options = SinkOptions());
     ~FileSink() {};
-    void writeTile(int res, int z, int x, int y, const std::string& buf) override;
+    void writeTile(int res, int z, int x, int y, std::shared_ptr<const std::string> buf) override;
+    void deleteTile(int res, int z, int x, int y) override;
+    void writeProgress(int z, int x, int y) override;
+    std::vector<std::tuple<int,int,int>> readProgress() override;
+    void finish() override;
 
     private:
+    std::string tilePath(int res, int z, int x, int y) const;
+
     std::string mOutput;
+    std::string mExtension;
     std::set<std::string> mCreatedDirs;
     std::mutex mCreatedDirsMutex;
+    // one z/x/y line per finished source tile
+    std::ofstream mJournal;
+    std::mutex mJournalMutex;
 };
 
+// All SQLite work happens on one writer thread fed through a bounded queue;
+// writeTile only hashes and enqueues, and blocks while the queue is full.
+// Progress rows travel through the same queue, so a source tile is only
+// recorded as finished in the transaction that commits its last display tile.
 class MbtilesSink : public Sink {
     public:
-    MbtilesSink(const std::string &path);
+    MbtilesSink(const std::string &path, const SinkOptions &options = SinkOptions());
     ~MbtilesSink();
-    void writeTile(int res, int z, int x, int y, const std::string& buf) override;
+    void writeTile(int res, int z, int x, int y, std::shared_ptr<const std::string> buf) override;
+    void deleteTile(int res, int z, int x, int y) override;
+    void writeProgress(int z, int x, int y) override;
+    std::vector<std::tuple<int,int,int>> readProgress() override;
+    void finish() override;
     void writeMetadata(const std::map<std::string,std::string>& metadata) override;
 
     private:
+    enum class Op { Write, Delete, Progress };
+
+    struct Item {
+        Op op;
+        int z;
+        int x;
+        int y;
+        std::shared_ptr<const std::string> data;
+        std::pair<uint64_t,uint64_t> id; // content hash, when deduplicating
+    };
+
+    struct ImageIdHash {
+        size_t operator()(const std::pair<uint64_t,uint64_t> &id) const { return id.first; }
+    };
+
+    void writer();
+    void insert(const Item &item);
+    void ensureIndex(const std::string &name, const std::string &table, const std::string &columns);
+
     std::string mOutput;
+    SinkOptions mOptions;
     sqlite3 * mDb;
+    // held by the writer while it uses mDb, and by writeMetadata
+    std::mutex mDbMutex;
+    sqlite3_stmt * mTileStmt = nullptr;
+    sqlite3_stmt * mMapStmt = nullptr;
+    sqlite3_stmt * mImageStmt = nullptr;
+    sqlite3_stmt * mDeleteStmt = nullptr;
+    sqlite3_stmt * mProgressStmt = nullptr;
+    BoundedQueue<Item> mQueue;
+    std::atomic<bool> mDone{false};
+    bool mFinished = false;
+    std::thread mWriter;
+    // content hashes of images already stored; only touched by the writer
+    std::unordered_set<std::pair<uint64_t,uint64_t>,ImageIdHash> mImageIds;
 };
 
-}
\ No newline at end of file
+}
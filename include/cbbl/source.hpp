@@ -2,7 +2,13 @@
 #include <memory>
 #include <string>
 #include <fstream>
+#include <vector>
+#include <tuple>
+#include <deque>
+#include <mutex>
+#include <functional>
 #include "sqlite3.h"
+#include "protozero/data_view.hpp"
 #define USE_STANDALONE_ASIO true
 #include "client_http.hpp"
 
@@ -14,23 +20,61 @@ struct TileData {
     std::string body;
     bool ok;
     std::string error;
+    double decompress_ms = 0;
 };
 
+using FetchCallback = std::function<void(std::shared_ptr<TileData>)>;
+
 class Source {
    public:
       virtual const std::shared_ptr<TileData> fetch(int z, int x, int y) = 0;
+      // true if fetchAsync returns without waiting for the tile
+      virtual bool async() const { return false; }
+      // calls done once the tile's bytes have arrived; by default fetches on the calling thread
+      virtual void fetchAsync(int z, int x, int y, FetchCallback done) { done(fetch(z,x,y)); }
+      // fetchAsync calls queued behind others, not yet sent
+      virtual size_t waiting() { return 0; }
       virtual ~Source() {}
       virtual const std::map<std::string,std::string> metadata() { return {}; }
       virtual const std::tuple<std::string,std::string,std::string> center() { return {"0","0","0"}; };
       virtual const std::tuple<std::string,std::string,std::string,std::string> bounds() { return {"-180","-90","180","90"}; };
 };
 
-std::unique_ptr<Source> CreateSource(const std::string &s);
+struct SourceOptions {
+    // http: if set, fetchAsync runs on this io_context instead of blocking
+    std::shared_ptr<asio::io_context> io;
+    // http: requests in flight at once; more wait in a queue
+    int max_in_flight = 32;
+    // http: seconds allowed for a whole request and for connecting
+    int timeout = 10;
+    int connect_timeout = 3;
+};
+
+std::unique_ptr<Source> CreateSource(const std::string &s, const SourceOptions &options = SourceOptions());
 
 class FileSource : public Source {
 
 };
 
+// Which source tiles an MbtilesSource iterates over and counts; applied in SQL.
+struct TileFilter {
+    int minzoom = 0;
+    int maxzoom = 14;
+    // west, south, east, north in degrees; empty for the whole world
+    std::vector<double> bbox;
+    // file with one source tile z/x/y per line; empty for all tiles
+    std::string tiles_file;
+    // keep only shard `shard` (0-based) of `shards` equal parts of the Hilbert curve order
+    int shard = 0;
+    int shards = 1;
+    // relative cost of a source tile at each zoom, used to balance shards
+    std::vector<double> zoom_weights;
+};
+
+// column and row of the tile at zoom z containing lon or lat, clamped to the world
+int lonToX(double lon, int z);
+int latToY(double lat, int z);
+
 class MbtilesSource : public Source {
     public:
         class Iterator {
@@ -42,7 +86,7 @@ class MbtilesSource : public Source {
             int z;
             int x;
             int y;
-            std::string data; // already decompressed
+            protozero::data_view blob; // compressed tile_data, valid until the next call to next()
 
             private:
             sqlite3_stmt *stmt;
@@ -56,20 +100,84 @@ class MbtilesSource : public Source {
         const std::map<std::string,std::string> metadata() override;
 
         const std::vector<std::pair<int,int>> zoom_count();
+        // up to count tiles at zoom z within the filter; the same seed picks the same tiles
+        std::vector<std::tuple<int,int,int>> sample(int z, int count, uint64_t seed);
+
+        // restricts Iterator and zoom_count to the tiles matched by filter
+        void setFilter(const TileFilter &filter);
+        // further restricts them to the listed tiles; shard boundaries are unaffected
+        void restrictTo(const std::vector<std::tuple<int,int,int>> &tiles);
+        // or leaves out the listed tiles
+        void exclude(const std::vector<std::tuple<int,int,int>> &tiles);
+        // the WHERE clause for the current filter, usable against any table with tile coordinates
+        const std::string &filterSql() const { return where; }
+        // the tiles of each temp table filterSql() refers to, by table name
+        const std::map<std::string,std::vector<std::tuple<int,int,int>>> &tileLists() const { return tile_lists; }
 
     private:
         sqlite3 * db;
         sqlite3_stmt * stmt;
+        std::string where;
+        std::map<std::string,std::vector<std::tuple<int,int,int>>> tile_lists;
+
+};
 
+// registers the SQL functions used by filterSql() on db
+void addTileFunctions(sqlite3 *db);
+
+// Content hashes of the source tiles an output was rendered from, kept in a
+// SQLite file next to the output so a later run can tell which tiles changed.
+class SourceHashes {
+    public:
+        // region is source's filter as it is now, with any tile lists it uses copied over;
+        // throws if the hashes file can't be opened
+        SourceHashes(const std::string &path, const MbtilesSource &source);
+        ~SourceHashes();
+
+        // records a tile of the new source
+        void add(int z, int x, int y, const protozero::data_view &blob);
+        // replaces the stored hashes in region with those of an earlier source
+        void loadPrevious(MbtilesSource &previous);
+        // tiles added since, or different from, the stored hashes
+        std::vector<std::tuple<int,int,int>> changed();
+        // stored tiles in region that are not in the new source
+        std::vector<std::tuple<int,int,int>> removed();
+        // makes the recorded tiles the stored hashes for region; throws on a SQLite error
+        void commit();
+
+    private:
+        sqlite3 * db;
+        sqlite3_stmt * insert_stmt;
+        std::string region;
 };
 
+// Fetches z/x/y.pbf from an upstream server. With an io_context in the options,
+// fetchAsync shares one client, and so one set of keep-alive connections, between
+// all callers, and never has more than max_in_flight requests outstanding.
 class HttpSource : public Source {
     public:
-        HttpSource(const std::string &tile_url);
+        HttpSource(const std::string &tile_url, const SourceOptions &options = SourceOptions());
         ~HttpSource();
         const std::shared_ptr<TileData> fetch(int z, int x, int y) override;
+        bool async() const override { return (bool)async_client; }
+        void fetchAsync(int z, int x, int y, FetchCallback done) override;
+        size_t waiting() override;
 
     private:
+        using Client = SimpleWeb::Client<SimpleWeb::HTTP>;
+        struct Request {
+            std::string path;
+            FetchCallback done;
+        };
+
+        void start(Request request);
+        void finished();
+
         SimpleWeb::Client<SimpleWeb::HTTP> client;
+        std::unique_ptr<Client> async_client;
+        SourceOptions options;
+        std::mutex queue_mutex;
+        int in_flight = 0;
+        std::deque<Request> queue;
 };
 }
\ No newline at end of file
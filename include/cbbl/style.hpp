@@ -0,0 +1,72 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <set>
+#include "mapnik/map.hpp"
+
+namespace cbbl {
+// A compiled map style: map.xml parsed once into a prototype Map, plus the
+// source layer -> style table from layers.txt. Immutable after construction,
+// so one instance can be shared by every render thread.
+class Style {
+    public:
+    Style(const std::string &map_dir);
+
+    const std::string &dir() const { return mDir; }
+    const mapnik::Map &map() const { return mMap; }
+    const std::vector<std::pair<std::string,std::string>> &layers() const { return mLayers; }
+    // unique per loaded Style in this process
+    int version() const { return mVersion; }
+    // hash of map.xml and layers.txt; unlike version() it is stable across restarts
+    uint64_t fingerprint() const { return mFingerprint; }
+    // time spent parsing map.xml and layers.txt
+    double loadMs() const { return mLoadMs; }
+    // true if every style drawing source_layer only has polygon fills, so a
+    // polygon covering a tile looks the same in any part of it
+    bool fillOnly(const std::string &source_layer) const { return mFillOnly.count(source_layer) > 0; }
+    // false if map.xml adds a background image or layers of its own, whose
+    // output depends on where the tile is
+    bool uniformSafe() const { return mUniformSafe; }
+    // false if no rule of the style of layers()[index] is active at display zoom z,
+    // so rendering can leave the layer out
+    bool drawn(size_t index, int z) const { return z < 0 || z >= (int)mDrawn.size() || mDrawn[z][index]; }
+    // false if no layer drawn at display zoom z reads source_layer, so it need not be decoded
+    bool reads(const std::string &source_layer, int z) const { return z < 0 || z >= (int)mReads.size() || mReads[z].count(source_layer) > 0; }
+
+    private:
+    std::string mDir;
+    mapnik::Map mMap;
+    std::vector<std::pair<std::string,std::string>> mLayers;
+    int mVersion;
+    uint64_t mFingerprint;
+    double mLoadMs;
+    std::set<std::string> mFillOnly;
+    bool mUniformSafe;
+    std::vector<std::vector<bool>> mDrawn;  // by display zoom, then layers() index
+    std::vector<std::set<std::string>> mReads; // by display zoom
+};
+
+// Owns the current Style for a long-running server. start() watches map.xml,
+// layers.txt and fonts/ and compiles a new Style in the background when they
+// change; current() returns whichever version was live when it is called, so
+// renders already holding the old version finish with it.
+class StyleWatcher {
+    public:
+    StyleWatcher(const std::string &map_dir);
+    ~StyleWatcher();
+    std::shared_ptr<const Style> current() const { return std::atomic_load(&mStyle); }
+    void start();
+
+    private:
+    void watch();
+    void reload(bool fonts_changed);
+
+    std::string mDir;
+    std::shared_ptr<const Style> mStyle;
+    std::thread mThread;
+    std::atomic<bool> mStop{false};
+};
+}
@@ -1,11 +1,171 @@
 #pragma once
 #include "mapnik/image_util.hpp"
 #include "protozero/data_view.hpp"
+#include "cbbl/style.hpp"
+#include "cbbl/encode.hpp"
+#include "cbbl/cache.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace asio {
+    class thread_pool;
+}
 
 namespace cbbl {
+    // wall time spent in each phase of render(), in milliseconds
+    struct RenderTiming {
+        double datasource_ms = 0; // decoding vector tile layers into datasources
+        double setup_ms = 0;      // attaching layers to the prepared Map
+        double render_ms = 0;     // agg rasterization
+        double encode_ms = 0;     // encoding display tiles, in renderMetatile
+
+        RenderTiming &operator+=(const RenderTiming &o) {
+            datasource_ms += o.datasource_ms;
+            setup_ms += o.setup_ms;
+            render_ms += o.render_ms;
+            encode_ms += o.encode_ms;
+            return *this;
+        }
+    };
+
 	// z, x, y: the "metatile" coordinates, where a metatile is a single image corresponding to multiple display tiles;
 	// label placement happens per metatile.
 	// dz, dx, dy: the "datatile" coordinates, which correspond to the data in buffer
-    mapnik::image_rgba8 render(const std::string &map_dir, int z, int x, int y, int tile_scale, const protozero::data_view &buffer, int dz, int dx, int dy, int metatile_zdiff);
+    mapnik::image_rgba8 render(const Style &style, int z, int x, int y, int tile_scale, const protozero::data_view &buffer, int dz, int dx, int dy, int metatile_zdiff, RenderTiming *timing = nullptr);
+    // render into buf, which is cleared in place if it already has the metatile's size and reallocated if not
+    void render(const Style &style, int z, int x, int y, int tile_scale, const protozero::data_view &buffer, int dz, int dx, int dy, int metatile_zdiff, mapnik::image_rgba8 &buf, RenderTiming *timing = nullptr);
+
+    // A width x height image taken from the calling thread's pool of render buffers, and returned
+    // to it when destroyed; its contents are left from the last use. Once each thread has seen the
+    // metatile sizes it renders, rendering allocates no large buffers.
+    class PooledImage {
+        public:
+        PooledImage(unsigned width, unsigned height);
+        ~PooledImage();
+        PooledImage(const PooledImage &) = delete;
+        PooledImage &operator=(const PooledImage &) = delete;
+
+        mapnik::image_rgba8 &operator*() { return *mImage; }
+        mapnik::image_rgba8 *operator->() { return mImage.get(); }
+
+        private:
+        std::unique_ptr<mapnik::image_rgba8> mImage;
+    };
+
+    struct ImagePoolStats {
+        uint64_t allocations; // PooledImages that had to allocate a buffer
+        uint64_t reuses;      // PooledImages given an idle buffer
+        uint64_t idle_bytes;  // held by idle buffers across all threads
+    };
+    ImagePoolStats imagePoolStats();
+
+    struct FeatureIndex;
+
+    // A decompressed vector tile, and what can be known about it before rendering.
+    struct DataTile {
+        DataTile(int z, int x, int y, std::string body);
+        ~DataTile();
+
+        // The features of this tile whose bounding boxes reach tile z/x/y, a descendant of it,
+        // grown by margin times its width on every side; as a vector tile in this tile's own
+        // coordinates. The spatial index behind it is built by the first call and shared by later ones.
+        std::string clip(int z, int x, int y, double margin) const;
+
+        int z;
+        int x;
+        int y;
+        std::string body;
+        // no features at all, or a single polygon covering the whole tile
+        bool uniform = false;
+        // source layer of the covering polygon; empty if the tile has no features
+        std::string uniform_layer;
+        // the layer and properties of the covering polygon, equal for tiles that draw the same
+        std::string uniform_key;
+
+        private:
+        mutable std::once_flag mIndexOnce;
+        mutable std::unique_ptr<FeatureIndex> mIndex;
+    };
+
+    // Decompressed data tiles keyed by packTile(z,x,y,0), shared by the metatiles rendered from them.
+    using DataTileCache = LruCache<DataTile>;
+
+    // Encoded display tiles shared between uniform data tiles that draw the same thing.
+    class UniformTiles {
+        public:
+        // true if key has been seen; buf is then null if it did not render as one colour
+        bool find(const std::string &key, std::shared_ptr<const std::string> &buf);
+        void insert(const std::string &key, std::shared_ptr<const std::string> buf);
+
+        std::atomic<uint64_t> skipped{0};
+
+        private:
+        std::mutex mMutex;
+        std::unordered_map<std::string,std::shared_ptr<const std::string>> mTiles;
+    };
+
+    // true if every pixel of img equals the first one
+    bool isUniform(const mapnik::image_rgba8 &img);
+
+    // true if every pixel of the width x height block of img at x0,y0 is the same; color is set to it
+    bool solidColor(const mapnik::image_rgba8 &img, unsigned x0, unsigned y0, unsigned width, unsigned height, uint32_t &color);
+
+    // Encoded display tiles of a single colour, keyed by colour and size, for one encoder.
+    // Catches flat crops of any data tile: open water, background, mask fills.
+    class SolidTiles {
+        public:
+        // the encoding of img, whose pixels are all color; encoded on the first request only
+        std::shared_ptr<const std::string> get(uint32_t color, const mapnik::image_view_rgba8 &img, const Encoder &encoder);
+
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+
+        private:
+        // a style drawing gradients could produce many colours; past this they are encoded every time
+        static const size_t MAX_SOLID_TILES = 4096;
+        std::mutex mMutex;
+        std::unordered_map<uint64_t,std::shared_ptr<const std::string>> mTiles;
+    };
+
+    struct RenderOptions {
+        Encoder encoder;
+        // if set, the display tiles of @2x and @3x metatiles are encoded in parallel on it
+        asio::thread_pool *encode_pool = nullptr;
+        int encode_threads = 0;
+        // if set, a uniform data tile is rendered and encoded once per zoom and scale and the bytes are reused
+        UniformTiles *uniform = nullptr;
+        // if set, display tiles of one colour reuse their encoded bytes instead of being encoded
+        SolidTiles *solid = nullptr;
+    };
+
+    // Renders metatile z/x/y and encodes each of its 2^zdiff x 2^zdiff display tiles,
+    // indexed i * n + j for column i, row j.
+    std::vector<std::shared_ptr<const std::string>> renderMetatile(const Style &style, const DataTile &data, int z, int x, int y, int tile_scale, int metatile_zdiff, const RenderOptions &options, RenderTiming *timing = nullptr);
+
+    // Shrinks img by an integer factor into out, averaging each factor x factor block in linear light.
+    void downsample(const mapnik::image_rgba8 &img, int factor, mapnik::image_rgba8 &out);
+
+    // per-channel differences between true renders and the downsampled images standing in for them
+    struct ImageDiff {
+        uint64_t images = 0;
+        uint64_t channels = 0;
+        uint64_t sum_abs = 0;
+        double sum_sq = 0;
+        int max_abs = 0;
+
+        void add(const mapnik::image_rgba8 &expected, const mapnik::image_rgba8 &actual);
+        ImageDiff &operator+=(const ImageDiff &o);
+        double meanAbs() const { return channels ? (double)sum_abs / channels : 0; }
+        // infinite if the images are identical
+        double psnr() const;
+    };
+
+    // renderMetatile at each of tile_scales, returned in that order. The metatile is rendered once at
+    // the largest scale; smaller scales that divide it are downsampled from that image, others rendered.
+    // If diff is set, each downsampled image is also compared against a true render at its scale.
+    std::vector<std::vector<std::shared_ptr<const std::string>>> renderMetatileScales(const Style &style, const DataTile &data, int z, int x, int y, const std::vector<int> &tile_scales, int metatile_zdiff, const RenderOptions &options, RenderTiming *timing = nullptr, ImageDiff *diff = nullptr);
 }
@@ -2,7 +2,7 @@
 #include <regex>
 
 namespace cbbl {
-    static std::string viewer(const std::tuple<std::string,std::string,std::string> &center, const std::tuple<std::string,std::string,std::string,std::string> &bounds) {
+    static std::string viewer(const std::tuple<std::string,std::string,std::string> &center, const std::tuple<std::string,std::string,std::string,std::string> &bounds, const std::string &extension = "png") {
         std::string page = R"HTMLLITERAL(
 <!DOCTYPE html>
 <html>
@@ -31,7 +31,7 @@ namespace cbbl {
             else if (window.devicePixelRatio == 2) ratio = '@2x';
             var map = L.map('map').setView([$CENTER_Y,$CENTER_X],$CENTER_ZOOM);
             var hash = new L.Hash(map)
-            L.tileLayer('/{z}/{x}/{y}{r}.png', {
+            L.tileLayer('/{z}/{x}/{y}{r}.$EXTENSION', {
                 attribution: '&copy; <a href="https://www.openstreetmap.org/copyright">OpenStreetMap</a> contributors',
                 r: ratio, 
                 maxZoom: 21,
@@ -48,6 +48,7 @@ namespace cbbl {
         page = std::regex_replace(page, std::regex("\\$MIN_Y"), std::get<1>(bounds));
         page = std::regex_replace(page, std::regex("\\$MAX_X"), std::get<2>(bounds));
         page = std::regex_replace(page, std::regex("\\$MAX_Y"), std::get<3>(bounds));
+        page = std::regex_replace(page, std::regex("\\$EXTENSION"), extension);
         return page;
     }
 }
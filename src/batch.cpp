@@ -1,17 +1,91 @@
 #include <set>
+#include <cmath>
+#include <condition_variable>
 #include "cxxopts.hpp"
+#include "gzip/decompress.hpp"
 #include "boost/filesystem.hpp"
 #include "boost/timer/progress_display.hpp"
 #include "mapnik/font_engine_freetype.hpp"
-#include "mapnik/image_view.hpp"
 #include "asio/thread_pool.hpp"
+#include "cbbl/scheduler.hpp"
+#include "cbbl/queue.hpp"
 #include "cbbl/source.hpp"
 #include "cbbl/sink.hpp"
 #include "cbbl/tile.hpp"
+#include "cbbl/metrics.hpp"
 #include "cbbl/viewer.hpp"
 
 using namespace std;
 
+// a source row as read, before decompression
+struct RawTile {
+    int z;
+    int x;
+    int y;
+    string compressed;
+};
+
+struct Metatile {
+    int res;
+    int z;
+    int x;
+    int y;
+    int zdiff;
+};
+
+// the metatiles rendered from data tile z/x/y whose display tiles fall in minzoom..maxzoom
+static void addMetatiles(vector<Metatile> &metatiles, int res, int z, int x, int y, int minzoom, int maxzoom) {
+    auto add = [&](int meta_z, int meta_x, int meta_y, int zdiff) {
+        if (meta_z + zdiff >= minzoom && meta_z + zdiff <= maxzoom) metatiles.push_back(Metatile{res,meta_z,meta_x,meta_y,zdiff});
+    };
+
+    // metatile = datatile
+    add(z,x,y,2);
+
+    // special case data tile 0,0,0 to output display levels 0 and 1
+    if (z == 0) {
+        add(0,0,0,1);
+        add(0,0,0,0);
+    }
+
+    // special case data tile 14: it outputs 17 to maxzoom
+    // uniform data tiles (ocean, empty) are rendered once per zoom and the encoded bytes reused
+    if (z == 14) {
+        for (int meta_z = 15; meta_z <= maxzoom - 2; meta_z++) {
+            int diff = meta_z - 14;
+            for (int u = 0; u < 1 << diff; u++) {
+                for (int v = 0; v < 1 << diff; v++) {
+                    add(meta_z,x * (1 << diff) + u,y * (1 << diff) + v,2);
+                }
+            }
+        }
+    }
+}
+
+// display tiles written for one data tile at zoom z
+static int64_t outputTiles(int z, const vector<int> &resolutions, int minzoom, int maxzoom) {
+    int64_t tiles = 0;
+    for (int res : resolutions) {
+        vector<Metatile> metatiles;
+        addMetatiles(metatiles,res,z,0,0,minzoom,maxzoom);
+        for (auto const &m : metatiles) tiles += 1 << (2 * m.zdiff);
+    }
+    return tiles;
+}
+
+// writes the display tiles of metatile z/x/y, in the order returned by renderMetatile
+static void writeMetatile(cbbl::Sink &sink, boost::timer::progress_display &progress, int res, int z, int x, int y, int zdiff, const vector<shared_ptr<const string>> &encoded) {
+    static mutex progress_mutex;
+    int n = 1 << zdiff;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            sink.writeTile(res,z + zdiff,x * n + i,y * n + j,encoded[i * n + j]);
+        }
+    }
+    lock_guard<mutex> lock(progress_mutex);
+    progress += n * n;
+}
+
 void cmdBatch(int argc, char * argv[]) {
     cxxopts::Options cmd_options("BATCH", "Batch rasterize tiles");
     cmd_options.add_options()
@@ -23,7 +97,20 @@ void cmdBatch(int argc, char * argv[]) {
         ("threads", "Number of rendering threads", cxxopts::value<int>())
         ("map", "directory of map style", cxxopts::value<string>())
         ("maxzoom", "maximum display zoom level (default 16, maximum 21", cxxopts::value<int>())
+        ("minzoom", "minimum display zoom level (default 0)", cxxopts::value<int>())
         ("resolutions", "comma-separated resolutions: default 1,2", cxxopts::value<vector<int>>())
+        ("bbox", "only render within west,south,east,north (degrees)", cxxopts::value<vector<double>>())
+        ("tiles", "only render the source tiles listed in this file, one z/x/y per line", cxxopts::value<string>())
+        ("resume", "continue an interrupted run into its existing output, skipping finished source tiles")
+        ("incremental", "update an existing output, re-rendering only source tiles that changed since it was rendered, and their neighbours. With --shard, only neighbours inside the shard are re-rendered: labels crossing a shard edge stay stale, so run incremental updates unsharded")
+        ("previous", "with --incremental: compare against this earlier source instead of the stored hashes", cxxopts::value<string>())
+        ("shard", "render shard i of N (0-based, e.g. 2/8); shards are balanced along a Hilbert curve", cxxopts::value<string>())
+        ("dedup", "mbtiles output: store identical images once (map/images schema)")
+        ("commit-size", "mbtiles output: tiles per transaction (default 1000)", cxxopts::value<int>())
+        ("format", "image format: png (default), png8, png8:z=9, jpeg85, webp", cxxopts::value<string>())
+        ("encode-threads", "extra threads helping render threads encode the tiles of @2x/@3x metatiles (default: threads / 4, 0 to disable)", cxxopts::value<int>())
+        ("downsample", "render each metatile once at the largest resolution and downsample it for the resolutions that divide it")
+        ("downsample-check", "with --downsample: also render every Nth metatile at each resolution and report the difference", cxxopts::value<int>())
       ;
 
     cmd_options.parse_positional({"cmd","source","destination"});
@@ -38,55 +125,183 @@ void cmdBatch(int argc, char * argv[]) {
         }
     }
 
+    int minzoom = 0;
+    if (result.count("minzoom")) minzoom = result["minzoom"].as<int>();
+
     vector<int> resolutions = {1,2};
     if (result.count("resolutions")) {
         resolutions = result["resolutions"].as<vector<int>>();
     }
 
-    cout << "rendering zooms 0-" << maxzoom << " at resolutions";
+    cout << "rendering zooms " << minzoom << "-" << maxzoom << " at resolutions";
     for (auto r : resolutions) cout << " @" << r << "x";
     cout << endl;
 
+    auto output = result["destination"].as<string>();
+    bool incremental = result.count("incremental");
+    bool resume = result.count("resume");
+    // content hashes of the source tiles the output was rendered from
+    string hashes_path = output + ".hashes";
+    if (boost::filesystem::exists(output) && !result.count("overwrite") && !incremental && !resume) {
+        cout << "Target output " << output << " exists." << endl;
+        exit(1);
+    }
+    if (incremental && !boost::filesystem::exists(output)) {
+        cout << "--incremental needs an existing output " << output << "." << endl;
+        exit(1);
+    }
+    if (resume && !boost::filesystem::exists(output)) {
+        cout << "--resume needs the output " << output << " of an interrupted run." << endl;
+        exit(1);
+    }
+    if (incremental && !result.count("previous") && !boost::filesystem::exists(hashes_path)) {
+        cout << "No source hashes at " << hashes_path << "; pass the source the output was rendered from with --previous." << endl;
+        exit(1);
+    }
+    // an mbtiles output holds one tile per z/x/y, so updating one in place needs a single resolution
+    bool mbtiles_output = output.size() >= 8 && output.compare(output.size() - 8,8,".mbtiles") == 0;
+    if ((incremental || resume) && mbtiles_output && resolutions.size() > 1) {
+        cout << "--incremental and --resume need a single --resolutions value for mbtiles output." << endl;
+        exit(1);
+    }
+    if (incremental && result.count("tiles")) {
+        cout << "--incremental and --tiles can't be combined." << endl;
+        exit(1);
+    }
+
     auto source = cbbl::MbtilesSource(result["source"].as<string>());
 
-    int total_output_tiles = 0;
-    int num_resolutions = resolutions.size();
-
-    for (auto p : source.zoom_count()) {
-        int zoom_level = get<0>(p);
-        int count = get<1>(p);
-        if (zoom_level == 0) {
-            total_output_tiles += (16 + 4 + 1) * num_resolutions;
-        } else if (zoom_level < 14) {
-            if (zoom_level <= maxzoom - 2) {
-                total_output_tiles += count * 16 * num_resolutions;
+    // data tile z renders display zoom z + 2; data tile 0 also renders 0 and 1, data tile 14 everything past 16
+    cbbl::TileFilter filter;
+    filter.minzoom = min(max(minzoom - 2,0),14);
+    filter.maxzoom = maxzoom - 2;
+    if (result.count("bbox")) {
+        filter.bbox = result["bbox"].as<vector<double>>();
+        if (filter.bbox.size() != 4) {
+            cout << "--bbox takes west,south,east,north." << endl;
+            exit(1);
+        }
+    }
+    if (result.count("tiles")) filter.tiles_file = result["tiles"].as<string>();
+    if (result.count("shard")) {
+        string shard = result["shard"].as<string>();
+        if (sscanf(shard.c_str(),"%d/%d",&filter.shard,&filter.shards) != 2 || filter.shard < 0 || filter.shard >= filter.shards) {
+            cout << "--shard takes i/N with 0 <= i < N." << endl;
+            exit(1);
+        }
+    }
+    for (int z = 0; z <= filter.maxzoom; z++) {
+        filter.zoom_weights.push_back(outputTiles(z,resolutions,minzoom,maxzoom));
+    }
+    source.setFilter(filter);
+
+    unique_ptr<cbbl::SourceHashes> hashes;
+    vector<tuple<int,int,int>> removed;
+    if (resume && !incremental) {
+        // the interrupted run's hashes were never committed; record the whole region again
+        hashes = make_unique<cbbl::SourceHashes>(hashes_path,source);
+        cbbl::MbtilesSource::Iterator scan(source);
+        while (scan.next()) hashes->add(scan.z,scan.x,scan.y,scan.blob);
+    }
+    if (incremental) {
+        hashes = make_unique<cbbl::SourceHashes>(hashes_path,source);
+        if (result.count("previous")) {
+            cbbl::MbtilesSource previous(result["previous"].as<string>());
+            cbbl::TileFilter previous_filter = filter;
+            previous_filter.shards = 1;
+            previous.setFilter(previous_filter);
+            try {
+                hashes->loadPrevious(previous);
+            } catch (const exception &e) {
+                cout << "Loading hashes of " << result["previous"].as<string>() << " failed: " << e.what() << endl;
+                exit(1);
             }
-        } else {
-            // zoom level == 14
-            for (int z = 16; z <= maxzoom; z++) {
-                total_output_tiles += count * (2 << (z - 16)) * 16 * num_resolutions;
+        }
+        {
+            cbbl::MbtilesSource::Iterator scan(source);
+            while (scan.next()) hashes->add(scan.z,scan.x,scan.y,scan.blob);
+        }
+        auto changed = hashes->changed();
+        removed = hashes->removed();
+        cout << changed.size() << " source tiles changed, " << removed.size() << " removed." << endl;
+
+        // labels near a tile edge are placed within the render buffer and can draw on the
+        // neighbouring metatile, so the 8 neighbours of a changed or removed tile are rendered again
+        vector<tuple<int,int,int>> dirty;
+        for (auto const *tiles : {&changed,&removed}) {
+            for (auto const &t : *tiles) {
+                int z = get<0>(t);
+                for (int dx = -1; dx <= 1; dx++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        int x = get<1>(t) + dx;
+                        int y = get<2>(t) + dy;
+                        if (x >= 0 && y >= 0 && x < (1 << z) && y < (1 << z)) dirty.emplace_back(z,x,y);
+                    }
+                }
             }
         }
+        source.restrictTo(dirty);
+        if (filter.shards > 1) {
+            cout << "Warning: with --shard, neighbours in other shards of changed tiles are not re-rendered." << endl;
+        }
     }
 
+    auto countOutputTiles = [&] {
+        int64_t tiles = 0;
+        for (auto p : source.zoom_count()) {
+            tiles += p.second * outputTiles(p.first,resolutions,minzoom,maxzoom);
+        }
+        return tiles;
+    };
+    int64_t total_output_tiles = countOutputTiles();
+
     cout << "Total output tiles: " << total_output_tiles << " Continue? (N) :";
     char ans = 'N';
     cin >> ans;
 
-    auto output = result["destination"].as<string>();
-    if (boost::filesystem::exists(output) && !result.count("overwrite")) {
-        cout << "Target output " << output << " exists." << endl;
-        exit(1);
+    if (!incremental && !resume) {
+        if (boost::filesystem::exists(output)) boost::filesystem::remove_all(output);
+        boost::filesystem::remove(hashes_path);
+        hashes = make_unique<cbbl::SourceHashes>(hashes_path,source);
     }
-    if (boost::filesystem::exists(output)) {
-        boost::filesystem::remove_all(output);
+
+    cbbl::RenderOptions render_options;
+    if (result.count("format")) render_options.encoder = cbbl::Encoder(result["format"].as<string>());
+
+    cbbl::SinkOptions sink_options;
+    sink_options.extension = render_options.encoder.extension();
+    sink_options.dedup = result.count("dedup");
+    if (result.count("commit-size")) sink_options.commit_size = result["commit-size"].as<int>();
+    sink_options.append = incremental || resume;
+    sink_options.resume = resume;
+    auto sink = cbbl::CreateSink(result["destination"].as<string>(),sink_options);
+    if (resume) {
+        auto finished = sink->readProgress();
+        cout << "Resuming: " << finished.size() << " source tiles already finished." << endl;
+        source.exclude(finished);
+        total_output_tiles = countOutputTiles();
     }
 
-    auto sink = cbbl::CreateSink(result["destination"].as<string>());
+    // display tiles rendered from source tiles that no longer exist
+    for (auto const &t : removed) {
+        for (int res : resolutions) {
+            vector<Metatile> metatiles;
+            addMetatiles(metatiles,res,get<0>(t),get<1>(t),get<2>(t),minzoom,maxzoom);
+            for (auto const &m : metatiles) {
+                int n = 1 << m.zdiff;
+                for (int i = 0; i < n; i++) {
+                    for (int j = 0; j < n; j++) {
+                        sink->deleteTile(res,m.z + m.zdiff,m.x * n + i,m.y * n + j);
+                    }
+                }
+            }
+        }
+    }
 
     auto metadata = source.metadata();
+    metadata["minzoom"] = to_string(minzoom);
     metadata["maxzoom"] = to_string(maxzoom);
-    metadata["format"] = "png";
+    metadata["format"] = render_options.encoder.extension();
     sink->writeMetadata(metadata);
 
     string map_dir = "example";
@@ -98,98 +313,192 @@ void cmdBatch(int argc, char * argv[]) {
         mapnik::freetype_engine::register_fonts("/usr/local/lib/mapnik/fonts");
     }
 
+    cbbl::Style style(map_dir);
+    cout << "loaded style " << map_dir << " in " << style.loadMs() << " ms" << endl;
+
     auto iter = cbbl::MbtilesSource::Iterator(source);
 
     int threads = 4;
     if (result.count("threads")) threads = result["threads"].as<int>();
-    asio::thread_pool pool(threads);
+    if (threads < 1) {
+        cout << "--threads must be at least 1." << endl;
+        exit(1);
+    }
+    cbbl::WorkStealingPool pool(threads);
+
+    render_options.encode_threads = threads / 4;
+    if (result.count("encode-threads")) render_options.encode_threads = result["encode-threads"].as<int>();
+    asio::thread_pool encode_pool(max(render_options.encode_threads,1));
+    if (render_options.encode_threads > 0) render_options.encode_pool = &encode_pool;
 
     chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 
+    cbbl::StageMetrics stages;
+    atomic<uint64_t> metatiles_rendered{0};
+
+    bool downsample = result.count("downsample");
+    int downsample_check = 0;
+    if (result.count("downsample-check")) downsample_check = result["downsample-check"].as<int>();
+    atomic<uint64_t> downsample_tasks{0};
+    mutex diff_mutex;
+    cbbl::ImageDiff downsample_diff;
+
+    cbbl::UniformTiles uniform;
+    render_options.uniform = &uniform;
+    cbbl::SolidTiles solid;
+    render_options.solid = &solid;
+
     boost::timer::progress_display show_progress( total_output_tiles );
-    while (iter.next()) {
-        int data_z = iter.z;
-        if (data_z > maxzoom - 2) continue;
-        int data_x = iter.x;
-        int data_y = iter.y;
-        string data = iter.data;
-        // TODO special case the empty tile to short-circuit 
-
-        asio::post(pool, [&show_progress,&sink,&resolutions,&map_dir,data_z,data_x,data_y,data,maxzoom] {
-            for (size_t res : resolutions) { // 1, 2 or 3
-                // metatile = datatile
-                auto img = cbbl::render(map_dir,data_z,data_x,data_y,res,data,data_z,data_x,data_y,2);
-                for (int i = 0; i < 4; i++) {
-                    for (int j = 0; j < 4; j++) {
-                        mapnik::image_view_rgba8 cropped{256*res*i,256*res*j,256*res,256*res,img};
-                        auto buf = mapnik::save_to_string(cropped,"png");
-                        int display_z = data_z + 2;
-                        int display_x = data_x * 4 + i;
-                        int display_y = data_y * 4 + j;
-                        sink->writeTile(res,display_z,display_x,display_y,buf);
-                        ++show_progress;
-                    }
-                }
 
-                // special case data tile 0,0,0 to output display levels 0 and 1
-                if (data_z == 0) {
-                    {
-                        auto img = cbbl::render(map_dir,0,0,0,res,data,0,0,0,1);
-                        for (int i = 0; i < 2; i++) {
-                            for (int j = 0; j < 2; j++) {
-                                mapnik::image_view_rgba8 cropped{256*res*i,256*res*j,256*res,256*res,img};
-                                auto buf = mapnik::save_to_string(cropped,"png");
-                                sink->writeTile(res,1,i,j,buf);
-                                ++show_progress;
-                            }
-                        }
-                    }
+    // The run is a pipeline with bounded stages, so memory stays flat however large the source is:
+    // read (this thread) -> decompress threads -> per-metatile render+encode tasks -> sink writer.
+    // A data tile holds one of max_in_flight slots from decompression until its last metatile is written.
+    const int max_in_flight = threads * 2;
+    mutex in_flight_mutex;
+    condition_variable in_flight_cv;
+    int in_flight = 0;
+
+    auto release = [&] {
+        lock_guard<mutex> lock(in_flight_mutex);
+        in_flight--;
+        in_flight_cv.notify_all();
+    };
+
+    auto expand = [&](shared_ptr<const cbbl::DataTile> data) {
+        vector<Metatile> metatiles;
+        if (downsample) {
+            // res 0: one task renders the metatile at every resolution
+            addMetatiles(metatiles,0,data->z,data->x,data->y,minzoom,maxzoom);
+        } else {
+            for (int res : resolutions) { // 1, 2 or 3
+                addMetatiles(metatiles,res,data->z,data->x,data->y,minzoom,maxzoom);
+            }
+        }
+
+        if (metatiles.empty()) {
+            sink->writeProgress(data->z,data->x,data->y);
+            release();
+            return;
+        }
 
-                    {
-                        auto img = cbbl::render(map_dir,0,0,0,res,data,0,0,0,0);
-                        auto buf = mapnik::save_to_string(img,"png");
-                        sink->writeTile(res,0,0,0,buf);
-                        ++show_progress;
+        // one task per metatile; every task of a data tile shares the same decoded DataTile
+        auto remaining = make_shared<atomic<int>>(metatiles.size());
+        for (auto const &m : metatiles) {
+            pool.post([&,data,remaining,m] {
+                cbbl::RenderTiming timing;
+                if (m.res == 0) {
+                    bool check = downsample_check > 0 && downsample_tasks++ % downsample_check == 0;
+                    cbbl::ImageDiff diff;
+                    auto encoded = cbbl::renderMetatileScales(style,*data,m.z,m.x,m.y,resolutions,m.zdiff,render_options,&timing,check ? &diff : nullptr);
+                    stages.add(timing);
+                    auto write_begin = chrono::steady_clock::now();
+                    for (size_t i = 0; i < resolutions.size(); i++) {
+                        writeMetatile(*sink,show_progress,resolutions[i],m.z,m.x,m.y,m.zdiff,encoded[i]);
+                    }
+                    stages.write.observe(cbbl::elapsedMs(write_begin));
+                    metatiles_rendered += resolutions.size();
+                    if (check) {
+                        lock_guard<mutex> lock(diff_mutex);
+                        downsample_diff += diff;
                     }
+                } else {
+                    auto encoded = cbbl::renderMetatile(style,*data,m.z,m.x,m.y,m.res,m.zdiff,render_options,&timing);
+                    stages.add(timing);
+                    auto write_begin = chrono::steady_clock::now();
+                    writeMetatile(*sink,show_progress,m.res,m.z,m.x,m.y,m.zdiff,encoded);
+                    stages.write.observe(cbbl::elapsedMs(write_begin));
+                    metatiles_rendered++;
+                }
+                if (--*remaining == 0) {
+                    sink->writeProgress(data->z,data->x,data->y);
+                    release();
                 }
+            });
+        }
+    };
 
-                // special case data tile 14: it outputs 17 to maxzoom
-                // TODO deduplication optimizations: if the relevant part of the tile is empty, don't call Mapnik
-                if (data_z == 14) {
-                    for (int meta_z = 15; meta_z <= maxzoom - 2; meta_z++) {
-                        int diff = meta_z - 14;
-                        for (int u = 0; u < 1 << diff; u++) {
-                            for (int v = 0; v < 1 << diff; v++) {
-                                int meta_x = data_x * (1 << diff) + u;
-                                int meta_y = data_y * (1 << diff) + v;
-                                auto img = cbbl::render(map_dir,meta_z,meta_x,meta_y,res,data,14,data_x,data_y,2);
-                                for (int i = 0; i < 4; i++) {
-                                    for (int j = 0; j < 4; j++) {
-                                        mapnik::image_view_rgba8 cropped{256*res*i,256*res*j,256*res,256*res,img};
-                                        auto buf = mapnik::save_to_string(cropped,"png");
-                                        int display_z = meta_z + 2;
-                                        int display_x = meta_x * 4 + i;
-                                        int display_y = meta_y * 4 + j;
-                                        sink->writeTile(res,display_z,display_x,display_y,buf);
-                                        ++show_progress;
-                                    }
-                                }
-                            }
-                        }
-                    }
+    cbbl::BoundedQueue<RawTile> raw_tiles(threads * 4);
+    atomic<bool> reading_done{false};
+    vector<thread> decompressors;
+    for (int t = 0; t < max(1,threads / 8); t++) {
+        decompressors.emplace_back([&] {
+            RawTile raw;
+            while (raw_tiles.pop(raw,[&] { return reading_done.load(); })) {
+                auto decompress_begin = chrono::steady_clock::now();
+                string body = gzip::decompress(raw.compressed.data(),raw.compressed.size());
+                stages.decompress.observe(cbbl::elapsedMs(decompress_begin));
+                auto data = make_shared<const cbbl::DataTile>(raw.z,raw.x,raw.y,move(body));
+                {
+                    unique_lock<mutex> lock(in_flight_mutex);
+                    in_flight_cv.wait(lock,[&] { return in_flight < max_in_flight; });
+                    in_flight++;
                 }
+                // expanding on a worker puts the metatile tasks on its own deque; idle workers steal them
+                pool.post([&expand,data] { expand(data); });
             }
         });
     }
 
+    auto fetch_begin = chrono::steady_clock::now();
+    while (iter.next()) {
+        stages.fetch.observe(cbbl::elapsedMs(fetch_begin));
+        if (!incremental && !resume) hashes->add(iter.z,iter.x,iter.y,iter.blob);
+        // the blob is only valid until the next row, so this is the one copy of the compressed bytes
+        raw_tiles.push(RawTile{iter.z,iter.x,iter.y,string(iter.blob.data(),iter.blob.size())});
+        fetch_begin = chrono::steady_clock::now();
+    }
+    reading_done = true;
+    raw_tiles.wake();
+    for (auto &t : decompressors) t.join();
+
     pool.join();
+    encode_pool.join();
+
+    // only once every tile is written do the hashes describe the output
+    sink->finish();
+    sink.reset();
+    try {
+        hashes->commit();
+    } catch (const exception &e) {
+        // the tiles are written, but the next --incremental run can't trust the hashes
+        cout << "Storing source hashes in " << hashes_path << " failed: " << e.what() << endl;
+        boost::filesystem::remove(hashes_path);
+        exit(1);
+    }
+
     auto bounds = source.bounds();
     auto center = source.center();
     ofstream index;
     index.open(output + "/index.html");
-    index << cbbl::viewer(center,bounds) << endl;
+    index << cbbl::viewer(center,bounds,render_options.encoder.extension()) << endl;
     index.close();
 
     chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    cout << "Finished in " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.0 << " seconds." << endl;
+    double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.0;
+    cout << "Finished in " << seconds << " seconds." << endl;
+
+    // the same stage breakdown serve exposes on /metrics; stage sums are over all threads
+    cout << "{\"seconds\":" << seconds;
+    cout << ",\"threads\":" << threads;
+    cout << ",\"output_tiles\":" << total_output_tiles;
+    cout << ",\"metatiles\":" << metatiles_rendered;
+    cout << ",\"uniform_skipped\":" << uniform.skipped;
+    cout << ",\"solid_hits\":" << solid.hits;
+    cout << ",\"solid_misses\":" << solid.misses;
+    auto images = cbbl::imagePoolStats();
+    cout << ",\"image_allocations\":" << images.allocations;
+    cout << ",\"image_reuses\":" << images.reuses;
+    if (downsample_diff.images > 0) {
+        // psnr is null when every checked image matched exactly
+        double psnr = downsample_diff.psnr();
+        cout << ",\"downsample\":{\"checked\":" << downsample_diff.images;
+        cout << ",\"mean_abs_diff\":" << downsample_diff.meanAbs();
+        cout << ",\"max_abs_diff\":" << downsample_diff.max_abs;
+        cout << ",\"psnr_db\":";
+        if (isinf(psnr)) cout << "null"; else cout << psnr;
+        cout << "}";
+    }
+    cout << ",\"stages\":";
+    stages.writeJson(cout);
+    cout << "}" << endl;
 }
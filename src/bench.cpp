@@ -0,0 +1,270 @@
+#include <fstream>
+#include <condition_variable>
+#include <numeric>
+#include <thread>
+#include "cxxopts.hpp"
+#include "boost/filesystem.hpp"
+#include "mapnik/font_engine_freetype.hpp"
+#include "mapnik/debug.hpp"
+#include "cbbl/source.hpp"
+#include "cbbl/tile.hpp"
+#include "cbbl/metrics.hpp"
+
+using namespace std;
+
+// the stages bench times; the same names batch and /metrics use
+static const vector<string> STAGES = {"fetch","decompress","datasource","setup","render","encode"};
+
+// every timing of every stage, so percentiles are exact instead of bucketed
+struct StageTimes {
+    vector<vector<double>> ms = vector<vector<double>>(STAGES.size());
+
+    void add(double fetch, double decompress, const cbbl::RenderTiming &t) {
+        double values[] = {fetch,decompress,t.datasource_ms,t.setup_ms,t.render_ms,t.encode_ms};
+        for (size_t i = 0; i < STAGES.size(); i++) ms[i].push_back(values[i]);
+    }
+
+    void merge(const StageTimes &o) {
+        for (size_t i = 0; i < STAGES.size(); i++) ms[i].insert(ms[i].end(),o.ms[i].begin(),o.ms[i].end());
+    }
+};
+
+struct BenchRun {
+    string map;
+    int threads;
+    int metatiles = 0;
+    double seconds = 0;
+    StageTimes times;
+};
+
+static double stagePercentile(const BenchRun &run, int stage, double q) {
+    auto sorted = run.times.ms[stage];
+    sort(sorted.begin(),sorted.end());
+    return cbbl::percentile(sorted,q);
+}
+
+// all threads start and end each iteration together, so an iteration's wall time covers only its own tiles
+class Barrier {
+    public:
+    Barrier(int count) : mCount(count) { }
+
+    void wait() {
+        unique_lock<mutex> lock(mMutex);
+        int generation = mGeneration;
+        if (++mWaiting == mCount) {
+            mWaiting = 0;
+            mGeneration++;
+            mCv.notify_all();
+        } else {
+            mCv.wait(lock,[&] { return generation != mGeneration; });
+        }
+    }
+
+    private:
+    int mCount;
+    int mWaiting = 0;
+    int mGeneration = 0;
+    mutex mMutex;
+    condition_variable mCv;
+};
+
+// Renders each sampled data tile as the metatile batch renders for it at its own zoom, at every
+// resolution, warmup + iterations times over. Only the timed iterations are recorded.
+static BenchRun runBench(const string &source_path, const cbbl::Style &style, int threads, const vector<tuple<int,int,int>> &tiles, const vector<int> &resolutions, const cbbl::RenderOptions &render_options, int warmup, int iterations) {
+    BenchRun run;
+    run.map = style.dir();
+    run.threads = threads;
+
+    vector<pair<tuple<int,int,int>,int>> jobs;
+    for (auto const &t : tiles) {
+        for (int res : resolutions) jobs.emplace_back(t,res);
+    }
+
+    int rounds = warmup + iterations;
+    vector<atomic<size_t>> next(rounds);
+    for (auto &n : next) n = 0;
+    Barrier barrier(threads + 1);
+    mutex merge_mutex;
+    atomic<int> metatiles{0};
+
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            cbbl::MbtilesSource source(source_path);
+            StageTimes times;
+            for (int round = 0; round < rounds; round++) {
+                barrier.wait();
+                size_t i;
+                while ((i = next[round]++) < jobs.size()) {
+                    int z, x, y;
+                    tie(z,x,y) = jobs[i].first;
+                    auto fetch_begin = chrono::steady_clock::now();
+                    auto tile_data = source.fetch(z,x,y);
+                    double fetch_ms = cbbl::elapsedMs(fetch_begin) - tile_data->decompress_ms;
+                    if (!tile_data->ok) continue;
+                    cbbl::DataTile data(z,x,y,move(tile_data->body));
+                    cbbl::RenderTiming timing;
+                    cbbl::renderMetatile(style,data,z,x,y,jobs[i].second,2,render_options,&timing);
+                    if (round >= warmup) {
+                        times.add(fetch_ms,tile_data->decompress_ms,timing);
+                        metatiles++;
+                    }
+                }
+                barrier.wait();
+            }
+            lock_guard<mutex> lock(merge_mutex);
+            run.times.merge(times);
+        });
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        barrier.wait();
+        auto begin = chrono::steady_clock::now();
+        barrier.wait();
+        if (round >= warmup) run.seconds += cbbl::elapsedMs(begin) / 1000.0;
+    }
+    for (auto &w : workers) w.join();
+    run.metatiles = metatiles;
+    return run;
+}
+
+static void writeRun(ostream &out, const BenchRun &run) {
+    out << "{\"map\":\"" << run.map << "\"";
+    out << ",\"threads\":" << run.threads;
+    out << ",\"metatiles\":" << run.metatiles;
+    out << ",\"seconds\":" << run.seconds;
+    out << ",\"metatiles_per_s\":" << (run.seconds > 0 ? run.metatiles / run.seconds : 0);
+    out << ",\"stages\":{";
+    for (size_t i = 0; i < STAGES.size(); i++) {
+        auto const &ms = run.times.ms[i];
+        double sum = accumulate(ms.begin(),ms.end(),0.0);
+        if (i > 0) out << ",";
+        out << "\"" << STAGES[i] << "\":{\"count\":" << ms.size();
+        out << ",\"sum_s\":" << sum / 1000;
+        out << ",\"mean_ms\":" << (ms.empty() ? 0 : sum / ms.size());
+        out << ",\"p50_ms\":" << stagePercentile(run,i,0.5);
+        out << ",\"p95_ms\":" << stagePercentile(run,i,0.95);
+        out << ",\"p99_ms\":" << stagePercentile(run,i,0.99) << "}";
+    }
+    out << "}}";
+}
+
+// relative change against the first run, e.g. 0.1 for 10% more
+static double change(double base, double value) {
+    return base > 0 ? value / base - 1 : 0;
+}
+
+void cmdBench(int argc, char * argv[]) {
+    cxxopts::Options cmd_options("BENCH", "Benchmark rendering a fixed sample of source tiles");
+    cmd_options.add_options()
+        ("cmd", "Command to run", cxxopts::value<string>())
+        ("source", "Source e.g. example.mbtiles", cxxopts::value<string>())
+        ("map", "comma-separated directories of map styles to compare (default example)", cxxopts::value<vector<string>>())
+        ("threads", "comma-separated thread counts to compare (default 4)", cxxopts::value<vector<int>>())
+        ("minzoom", "lowest source zoom to sample (default 0)", cxxopts::value<int>())
+        ("maxzoom", "highest source zoom to sample (default 14)", cxxopts::value<int>())
+        ("samples", "source tiles sampled per zoom (default 10)", cxxopts::value<int>())
+        ("seed", "seed of the sample; the same seed and source give the same tiles (default 1)", cxxopts::value<int>())
+        ("iterations", "timed passes over the sample (default 3)", cxxopts::value<int>())
+        ("warmup", "untimed passes before them (default 1)", cxxopts::value<int>())
+        ("resolutions", "comma-separated resolutions: default 1,2", cxxopts::value<vector<int>>())
+        ("format", "image format: png (default), png8, png8:z=9, jpeg85, webp", cxxopts::value<string>())
+        ("output", "also write the JSON report to this file", cxxopts::value<string>())
+      ;
+
+    cmd_options.parse_positional({"cmd","source"});
+    auto result = cmd_options.parse(argc, argv);
+
+    if (!result.count("source")) {
+        cout << "bench needs a source mbtiles." << endl;
+        exit(1);
+    }
+    auto source_path = result["source"].as<string>();
+
+    vector<string> maps = {"example"};
+    if (result.count("map")) maps = result["map"].as<vector<string>>();
+    vector<int> thread_counts = {4};
+    if (result.count("threads")) thread_counts = result["threads"].as<vector<int>>();
+    int minzoom = 0;
+    if (result.count("minzoom")) minzoom = result["minzoom"].as<int>();
+    int maxzoom = 14;
+    if (result.count("maxzoom")) maxzoom = result["maxzoom"].as<int>();
+    int samples = 10;
+    if (result.count("samples")) samples = result["samples"].as<int>();
+    int seed = 1;
+    if (result.count("seed")) seed = result["seed"].as<int>();
+    int iterations = 3;
+    if (result.count("iterations")) iterations = result["iterations"].as<int>();
+    int warmup = 1;
+    if (result.count("warmup")) warmup = result["warmup"].as<int>();
+    vector<int> resolutions = {1,2};
+    if (result.count("resolutions")) resolutions = result["resolutions"].as<vector<int>>();
+
+    // every run renders everything; cached uniform tiles and a shared encode pool would hide the stage costs
+    cbbl::RenderOptions render_options;
+    if (result.count("format")) render_options.encoder = cbbl::Encoder(result["format"].as<string>());
+
+    vector<tuple<int,int,int>> tiles;
+    {
+        cbbl::MbtilesSource source(source_path);
+        for (int z = minzoom; z <= maxzoom; z++) {
+            auto picked = source.sample(z,samples,seed);
+            tiles.insert(tiles.end(),picked.begin(),picked.end());
+        }
+    }
+    cout << "sampled " << tiles.size() << " source tiles at zooms " << minzoom << "-" << maxzoom << " with seed " << seed << endl;
+
+    mapnik::logger::instance().set_severity(mapnik::logger::none);
+
+    vector<BenchRun> runs;
+    for (auto const &map_dir : maps) {
+        if (boost::filesystem::exists(map_dir + "/fonts")) {
+            mapnik::freetype_engine::register_fonts(map_dir + "/fonts");
+        } else {
+            mapnik::freetype_engine::register_fonts("/usr/local/lib/mapnik/fonts");
+        }
+        cbbl::Style style(map_dir);
+        cout << "loaded style " << map_dir << " in " << style.loadMs() << " ms" << endl;
+
+        for (int threads : thread_counts) {
+            runs.push_back(runBench(source_path,style,threads,tiles,resolutions,render_options,warmup,iterations));
+            auto const &run = runs.back();
+            cout << map_dir << " with " << threads << " threads: " << run.metatiles / run.seconds << " metatiles/s";
+            cout << " (render p50 " << stagePercentile(run,4,0.5) << " ms, p95 " << stagePercentile(run,4,0.95) << " ms)" << endl;
+        }
+    }
+
+    // every run against the first, which is the baseline
+    for (size_t r = 1; r < runs.size(); r++) {
+        cout << runs[r].map << " with " << runs[r].threads << " threads vs " << runs[0].map << " with " << runs[0].threads << " threads:";
+        cout << " throughput " << showpos << change(runs[0].metatiles / runs[0].seconds,runs[r].metatiles / runs[r].seconds) * 100 << "%";
+        for (size_t i = 0; i < STAGES.size(); i++) {
+            cout << ", " << STAGES[i] << " p95 " << change(stagePercentile(runs[0],i,0.95),stagePercentile(runs[r],i,0.95)) * 100 << "%";
+        }
+        cout << noshowpos << endl;
+    }
+
+    ostringstream json;
+    json << "{\"source\":\"" << source_path << "\"";
+    json << ",\"seed\":" << seed;
+    json << ",\"minzoom\":" << minzoom;
+    json << ",\"maxzoom\":" << maxzoom;
+    json << ",\"source_tiles\":" << tiles.size();
+    json << ",\"resolutions\":[";
+    for (size_t i = 0; i < resolutions.size(); i++) json << (i > 0 ? "," : "") << resolutions[i];
+    json << "],\"format\":\"" << render_options.encoder.format() << "\"";
+    json << ",\"warmup\":" << warmup;
+    json << ",\"iterations\":" << iterations;
+    json << ",\"runs\":[";
+    for (size_t r = 0; r < runs.size(); r++) {
+        if (r > 0) json << ",";
+        writeRun(json,runs[r]);
+    }
+    json << "]}";
+
+    cout << json.str() << endl;
+    if (result.count("output")) {
+        ofstream out(result["output"].as<string>());
+        out << json.str() << endl;
+    }
+}
@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "boost/filesystem.hpp"
+#include "cbbl/cache.hpp"
+
+using namespace std;
+
+namespace cbbl {
+// file layout: "CBMT", uint32 count, count x (uint32 offset, uint32 length), tile data
+static const char MAGIC[4] = {'C','B','M','T'};
+// present in every cache directory
+static const char MARKER[] = ".cbbl-disk-cache";
+
+DiskCache::DiskCache(const string &dir, size_t max_bytes) : mDir(dir), mMaxBytes(max_bytes) {
+    while (mDir.size() > 1 && mDir.back() == '/') mDir.pop_back();
+    // only a directory this class created, or an empty one, is ever written to or cleaned up
+    string marker = mDir + "/" + MARKER;
+    if (!boost::filesystem::exists(marker)) {
+        if (boost::filesystem::exists(mDir) && !boost::filesystem::is_empty(mDir)) {
+            throw runtime_error(mDir + " is not empty and not a cbbl disk cache");
+        }
+        boost::filesystem::create_directories(mDir);
+        ofstream(marker) << "cbbl disk cache" << endl;
+    }
+    vector<tuple<time_t,string,size_t>> found;
+    for (auto &entry : boost::filesystem::recursive_directory_iterator(mDir)) {
+        if (!boost::filesystem::is_regular_file(entry.path())) continue;
+        string name = entry.path().filename().string();
+        if (name.find(".meta.tmp") != string::npos) {
+            // leftover temporary file from an interrupted write
+            boost::filesystem::remove(entry.path());
+            continue;
+        }
+        if (entry.path().extension() != ".meta") continue;
+        string rel = entry.path().string().substr(mDir.size() + 1);
+        found.emplace_back(boost::filesystem::last_write_time(entry.path()),rel,boost::filesystem::file_size(entry.path()));
+    }
+    // oldest first, so the newest files end up at the front of the LRU list
+    sort(found.begin(),found.end());
+    for (auto &f : found) touch(std::get<1>(f),std::get<2>(f));
+    lock_guard<mutex> lock(mMutex);
+    evict();
+    cout << "disk cache " << mDir << ": " << mIndex.size() << " metatiles, " << mBytes / (1024 * 1024) << " MB" << endl;
+}
+
+shared_ptr<const string> DiskCache::get(const string &path, int index) {
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = mIndex.find(path);
+        if (it == mIndex.end()) {
+            mMisses++;
+            return nullptr;
+        }
+        mLru.splice(mLru.begin(),mLru,it->second.first);
+    }
+
+    // the file may be evicted concurrently; once open it stays readable
+    int fd = open((mDir + "/" + path).c_str(),O_RDONLY);
+    if (fd < 0) {
+        mMisses++;
+        return nullptr;
+    }
+    shared_ptr<const string> result;
+    struct stat st;
+    if (fstat(fd,&st) == 0 && st.st_size >= 8) {
+        size_t size = st.st_size;
+        void *addr = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (addr != MAP_FAILED) {
+            const char *base = (const char *)addr;
+            uint32_t count;
+            memcpy(&count,base + 4,4);
+            if (memcmp(base,MAGIC,4) == 0 && index >= 0 && (uint32_t)index < count && 8 + 8 * (size_t)count <= size) {
+                uint32_t offset, length;
+                memcpy(&offset,base + 8 + 8 * index,4);
+                memcpy(&length,base + 12 + 8 * index,4);
+                if ((size_t)offset + length <= size) result = make_shared<const string>(base + offset,length);
+            }
+            munmap(addr,size);
+        }
+    }
+    close(fd);
+    if (result) mHits++; else mMisses++;
+    return result;
+}
+
+void DiskCache::put(const string &path, const vector<shared_ptr<const string>> &tiles) {
+    uint32_t count = tiles.size();
+    uint32_t offset = 8 + 8 * count;
+    string header(MAGIC,4);
+    header.append((const char *)&count,4);
+    for (auto const &t : tiles) {
+        uint32_t length = t->size();
+        header.append((const char *)&offset,4);
+        header.append((const char *)&length,4);
+        offset += length;
+    }
+
+    auto full = boost::filesystem::path(mDir) / path;
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(full.parent_path(),ec);
+    ostringstream tmp;
+    tmp << full.string() << ".tmp" << this_thread::get_id();
+    {
+        ofstream out(tmp.str(),ios_base::out|ios_base::binary|ios_base::trunc);
+        out.write(header.data(),header.size());
+        for (auto const &t : tiles) out.write(t->data(),t->size());
+        if (!out) {
+            boost::filesystem::remove(tmp.str(),ec);
+            return;
+        }
+    }
+    // readers only ever see a complete file
+    boost::filesystem::rename(tmp.str(),full,ec);
+    if (ec) return;
+
+    lock_guard<mutex> lock(mMutex);
+    touch(path,offset);
+    evict();
+}
+
+CacheStats DiskCache::stats() {
+    CacheStats s;
+    s.hits = mHits;
+    s.misses = mMisses;
+    s.evictions = mEvictions;
+    s.max_bytes = mMaxBytes;
+    lock_guard<mutex> lock(mMutex);
+    s.entries = mIndex.size();
+    s.bytes = mBytes;
+    return s;
+}
+
+// requires mMutex except during construction
+void DiskCache::touch(const string &path, size_t bytes) {
+    auto it = mIndex.find(path);
+    if (it != mIndex.end()) {
+        mBytes -= it->second.second;
+        mLru.erase(it->second.first);
+    }
+    mLru.push_front(path);
+    mIndex[path] = make_pair(mLru.begin(),bytes);
+    mBytes += bytes;
+}
+
+// requires mMutex
+void DiskCache::evict() {
+    while (mBytes > mMaxBytes && !mLru.empty()) {
+        auto const &path = mLru.back();
+        boost::system::error_code ec;
+        boost::filesystem::remove(boost::filesystem::path(mDir) / path,ec);
+        mBytes -= mIndex.at(path).second;
+        mIndex.erase(path);
+        mLru.pop_back();
+        mEvictions++;
+    }
+}
+}
@@ -9,7 +9,7 @@ using namespace std;
 
 void printHelp() {
     cout << "Command not recognized." << endl;
-    cout << "Commands: tile | batch | serve" << endl;
+    cout << "Commands: tile | batch | serve | bench | loadtest" << endl;
     exit(1);
 }
 
@@ -22,12 +22,17 @@ int main(int argc, char **argv)
     if (args[1] == "tile") {
         ifstream stream(args[2],std::ios_base::in|std::ios_base::binary);
         std::string buffer(std::istreambuf_iterator<char>(stream.rdbuf()),(std::istreambuf_iterator<char>()));
-        auto img = cbbl::render("debug",0,0,0,2,buffer,0,0,0,2);
+        cbbl::Style style("debug");
+        auto img = cbbl::render(style,0,0,0,2,buffer,0,0,0,2);
         mapnik::save_to_file(img ,args[3],"png");
     } else if (args[1] == "batch") {
         cmdBatch(argc,argv);
     } else if (args[1] == "serve") {
         cmdServe(argc,argv);
+    } else if (args[1] == "bench") {
+        cmdBench(argc,argv);
+    } else if (args[1] == "loadtest") {
+        cmdLoadtest(argc,argv);
     } else {
         printHelp();
     }
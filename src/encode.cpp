@@ -0,0 +1,30 @@
+#include <stdexcept>
+#include "mapnik/image_util.hpp"
+#include "mapnik/image.hpp"
+#include "cbbl/encode.hpp"
+
+using namespace std;
+
+namespace cbbl {
+Encoder::Encoder(const string &format) : mFormat(format) {
+    if (mFormat.compare(0,3,"png") == 0) {
+        mExtension = "png";
+        mContentType = "image/png";
+    } else if (mFormat.compare(0,4,"jpeg") == 0 || mFormat.compare(0,3,"jpg") == 0) {
+        mExtension = "jpg";
+        mContentType = "image/jpeg";
+    } else if (mFormat.compare(0,4,"webp") == 0) {
+        mExtension = "webp";
+        mContentType = "image/webp";
+    } else {
+        throw runtime_error("unsupported image format: " + mFormat);
+    }
+    // fail at startup rather than on the first tile if Mapnik was built without this format
+    mapnik::image_rgba8 probe(1,1);
+    encode(mapnik::image_view_rgba8{0,0,1,1,probe});
+}
+
+string Encoder::encode(const mapnik::image_view_rgba8 &img) const {
+    return mapnik::save_to_string(img,mFormat);
+}
+}
@@ -0,0 +1,351 @@
+#include <fstream>
+#include <random>
+#include <regex>
+#include <set>
+#include <thread>
+#include "cxxopts.hpp"
+#define USE_STANDALONE_ASIO true
+#include "client_http.hpp"
+
+#include "cbbl/source.hpp"
+#include "cbbl/metrics.hpp"
+
+using namespace std;
+using HttpClient = SimpleWeb::Client<SimpleWeb::HTTP>;
+
+// a display tile as serve's tile route names it
+struct TileRequest {
+    int z;
+    int x;
+    int y;
+    int scale;
+};
+
+static string tileUrl(const TileRequest &t, const string &extension) {
+    ostringstream ss;
+    ss << "/" << t.z << "/" << t.x << "/" << t.y;
+    if (t.scale > 1) ss << "@" << t.scale << "x";
+    ss << "." << extension;
+    return ss.str();
+}
+
+// every z/x/y or z/x/y@Nx in the log, in order; works on bare lists and on web server access logs
+static vector<TileRequest> readLog(const string &path) {
+    vector<TileRequest> requests;
+    regex tile_re("(^|/)([0-9]+)/([0-9]+)/([0-9]+)(@([2-3])x)?");
+    ifstream in(path);
+    string line;
+    smatch m;
+    while (getline(in,line)) {
+        if (!regex_search(line,m,tile_re)) continue;
+        int scale = m[6].length() > 0 ? stoi(m[6]) : 1;
+        requests.push_back(TileRequest{stoi(m[2]),stoi(m[3]),stoi(m[4]),scale});
+    }
+    return requests;
+}
+
+// A user looking at a width x height tile viewport: starts at a random place and zoom, then pans
+// or zooms step by step. Like a browser, only tiles not already on screen are requested.
+class Session {
+    public:
+    Session(mt19937_64 &rng, const vector<double> &bbox, int minzoom, int maxzoom, int width, int height, int scale)
+        : mRng(rng), mBbox(bbox), mMinzoom(minzoom), mMaxzoom(maxzoom), mWidth(width), mHeight(height), mScale(scale) {
+        mZ = uniform_int_distribution<int>(minzoom,maxzoom)(mRng);
+        place();
+    }
+
+    vector<TileRequest> step() {
+        auto before = visible();
+        double r = uniform_real_distribution<double>(0,1)(mRng);
+        if (r < 0.6) {
+            uniform_real_distribution<double> dx(-mWidth / 2.0,mWidth / 2.0), dy(-mHeight / 2.0,mHeight / 2.0);
+            mX += dx(mRng);
+            mY += dy(mRng);
+        } else if (r < 0.8 && mZ < mMaxzoom) {
+            mZ++;
+            mX *= 2;
+            mY *= 2;
+            before.clear();
+        } else if (mZ > mMinzoom) {
+            mZ--;
+            mX /= 2;
+            mY /= 2;
+            before.clear();
+        }
+        clamp();
+        vector<TileRequest> requests;
+        for (auto const &t : visible()) {
+            if (!before.count(t)) requests.push_back(TileRequest{mZ,t.first,t.second,mScale});
+        }
+        return requests;
+    }
+
+    vector<TileRequest> start() {
+        vector<TileRequest> requests;
+        for (auto const &t : visible()) requests.push_back(TileRequest{mZ,t.first,t.second,mScale});
+        return requests;
+    }
+
+    private:
+    void place() {
+        const double lat_max = 85.0511287798;
+        int west = cbbl::lonToX(mBbox[0],mZ), east = cbbl::lonToX(mBbox[2],mZ);
+        int north = cbbl::latToY(min(mBbox[3],lat_max),mZ), south = cbbl::latToY(max(mBbox[1],-lat_max),mZ);
+        mX = uniform_real_distribution<double>(west,east + 1)(mRng);
+        mY = uniform_real_distribution<double>(north,south + 1)(mRng);
+        clamp();
+    }
+
+    void clamp() {
+        double n = 1 << mZ;
+        mX = min(max(mX,0.0),n);
+        mY = min(max(mY,0.0),n);
+    }
+
+    set<pair<int,int>> visible() {
+        set<pair<int,int>> tiles;
+        int n = 1 << mZ;
+        int x0 = max((int)floor(mX - mWidth / 2.0),0), x1 = min((int)ceil(mX + mWidth / 2.0),n);
+        int y0 = max((int)floor(mY - mHeight / 2.0),0), y1 = min((int)ceil(mY + mHeight / 2.0),n);
+        for (int x = x0; x < x1; x++) {
+            for (int y = y0; y < y1; y++) tiles.emplace(x,y);
+        }
+        return tiles;
+    }
+
+    mt19937_64 &mRng;
+    vector<double> mBbox;
+    int mMinzoom;
+    int mMaxzoom;
+    int mWidth;
+    int mHeight;
+    int mScale;
+    int mZ;
+    double mX; // viewport centre, in tiles at mZ
+    double mY;
+};
+
+// concurrency sessions at a time, their requests interleaved as if the users were browsing side by side
+static vector<TileRequest> synthesize(size_t count, int concurrency, int steps, uint64_t seed, const vector<double> &bbox, int minzoom, int maxzoom, int width, int height, int scale) {
+    mt19937_64 rng(seed);
+    vector<TileRequest> requests;
+    while (requests.size() < count) {
+        size_t before = requests.size();
+        vector<vector<TileRequest>> batch;
+        for (int s = 0; s < concurrency; s++) {
+            Session session(rng,bbox,minzoom,maxzoom,width,height,scale);
+            auto r = session.start();
+            for (int i = 0; i < steps; i++) {
+                auto more = session.step();
+                r.insert(r.end(),more.begin(),more.end());
+            }
+            batch.push_back(move(r));
+        }
+        for (size_t i = 0; requests.size() < count; i++) {
+            bool any = false;
+            for (auto const &r : batch) {
+                if (i >= r.size() || requests.size() >= count) continue;
+                requests.push_back(r[i]);
+                any = true;
+            }
+            if (!any) break;
+        }
+        // sessions that yield no tiles (e.g. a degenerate --bbox) would never reach count
+        if (requests.size() == before) break;
+    }
+    return requests;
+}
+
+// the counters from serve's /metrics, or nothing if it can't be read
+static map<string,double> readMetrics(const string &host) {
+    map<string,double> values;
+    try {
+        HttpClient client(host);
+        client.config.timeout = 5;
+        auto response = client.request("GET","/metrics");
+        istringstream in(response->content.string());
+        string line;
+        while (getline(in,line)) {
+            if (line.empty() || line[0] == '#') continue;
+            auto space = line.rfind(' ');
+            if (space == string::npos) continue;
+            values[line.substr(0,space)] = atof(line.c_str() + space + 1);
+        }
+    } catch (const SimpleWeb::system_error &e) {
+    }
+    return values;
+}
+
+struct Outcome {
+    double ms;
+    int status; // 0 if the request failed before a response
+    size_t bytes;
+};
+
+void cmdLoadtest(int argc, char * argv[]) {
+    cxxopts::Options cmd_options("LOADTEST", "Send tile requests to a running cbbl serve");
+    cmd_options.add_options()
+        ("cmd", "Command to run", cxxopts::value<string>())
+        ("host", "serve instance e.g. localhost:8090", cxxopts::value<string>())
+        ("log", "replay the z/x/y[@Nx] tiles in this access log, in order", cxxopts::value<string>())
+        ("requests", "requests to send; with --log, 0 replays the whole log (default 1000)", cxxopts::value<int>())
+        ("concurrency", "requests in flight at once, and simulated users (default 8)", cxxopts::value<int>())
+        ("rate", "requests per second to start, 0 for as fast as responses come back (default 0)", cxxopts::value<double>())
+        ("steps", "pans and zooms per simulated user (default 20)", cxxopts::value<int>())
+        ("viewport", "tiles on a simulated screen, WxH (default 8x5)", cxxopts::value<string>())
+        ("bbox", "simulated users start within west,south,east,north (degrees)", cxxopts::value<vector<double>>())
+        ("minzoom", "lowest zoom simulated users go to (default 2)", cxxopts::value<int>())
+        ("maxzoom", "highest zoom simulated users go to (default 16)", cxxopts::value<int>())
+        ("scale", "resolution simulated users request: 1, 2 or 3 (default 1)", cxxopts::value<int>())
+        ("seed", "seed of the simulated sessions (default 1)", cxxopts::value<int>())
+        ("extension", "image extension serve was started with (default png)", cxxopts::value<string>())
+        ("timeout", "seconds before a request counts as failed (default 30)", cxxopts::value<int>())
+        ("output", "also write the JSON report to this file", cxxopts::value<string>())
+      ;
+
+    cmd_options.parse_positional({"cmd","host"});
+    auto result = cmd_options.parse(argc, argv);
+
+    string host = "localhost:8090";
+    if (result.count("host")) host = result["host"].as<string>();
+    int concurrency = 8;
+    if (result.count("concurrency")) concurrency = result["concurrency"].as<int>();
+    if (concurrency < 1) {
+        cout << "--concurrency must be at least 1." << endl;
+        exit(1);
+    }
+    double rate = 0;
+    if (result.count("rate")) rate = result["rate"].as<double>();
+    string extension = "png";
+    if (result.count("extension")) extension = result["extension"].as<string>();
+    int timeout = 30;
+    if (result.count("timeout")) timeout = result["timeout"].as<int>();
+
+    vector<TileRequest> requests;
+    if (result.count("log")) {
+        requests = readLog(result["log"].as<string>());
+        if (result.count("requests") && result["requests"].as<int>() > 0) {
+            requests.resize(min(requests.size(),(size_t)result["requests"].as<int>()));
+        }
+        cout << "replaying " << requests.size() << " requests from " << result["log"].as<string>() << endl;
+    } else {
+        int count = 1000;
+        if (result.count("requests")) count = result["requests"].as<int>();
+        int steps = 20;
+        if (result.count("steps")) steps = result["steps"].as<int>();
+        int width = 8, height = 5;
+        if (result.count("viewport") && sscanf(result["viewport"].as<string>().c_str(),"%dx%d",&width,&height) != 2) {
+            cout << "--viewport takes WxH, e.g. 8x5." << endl;
+            exit(1);
+        }
+        vector<double> bbox = {-180,-85.0511287798,180,85.0511287798};
+        if (result.count("bbox")) {
+            bbox = result["bbox"].as<vector<double>>();
+            if (bbox.size() != 4) {
+                cout << "--bbox takes west,south,east,north." << endl;
+                exit(1);
+            }
+        }
+        int minzoom = 2;
+        if (result.count("minzoom")) minzoom = result["minzoom"].as<int>();
+        int maxzoom = 16;
+        if (result.count("maxzoom")) maxzoom = result["maxzoom"].as<int>();
+        int scale = 1;
+        if (result.count("scale")) scale = result["scale"].as<int>();
+        int seed = 1;
+        if (result.count("seed")) seed = result["seed"].as<int>();
+        requests = synthesize(count,concurrency,steps,seed,bbox,minzoom,maxzoom,width,height,scale);
+        cout << "simulating " << concurrency << " users, " << requests.size() << " requests at zooms " << minzoom << "-" << maxzoom << endl;
+    }
+    if (requests.empty()) {
+        cout << "No tile requests to send." << endl;
+        exit(1);
+    }
+
+    auto metrics_before = readMetrics(host);
+
+    // with a rate, request i is due at begin + i / rate and its latency counts from then,
+    // so time spent queued behind a slow server is not hidden
+    atomic<size_t> next{0};
+    vector<Outcome> outcomes(requests.size());
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < concurrency; t++) {
+        workers.emplace_back([&] {
+            HttpClient client(host);
+            client.config.timeout = timeout;
+            size_t i;
+            while ((i = next++) < requests.size()) {
+                auto due = chrono::steady_clock::now();
+                if (rate > 0) {
+                    due = begin + chrono::microseconds((int64_t)(i * 1e6 / rate));
+                    this_thread::sleep_until(due);
+                }
+                Outcome outcome{0,0,0};
+                try {
+                    auto response = client.request("GET",tileUrl(requests[i],extension));
+                    outcome.bytes = response->content.size();
+                    outcome.status = stoi(response->status_code);
+                } catch (const exception &e) {
+                }
+                outcome.ms = cbbl::elapsedMs(due);
+                outcomes[i] = outcome;
+            }
+        });
+    }
+    for (auto &w : workers) w.join();
+    double seconds = cbbl::elapsedMs(begin) / 1000.0;
+
+    auto metrics_after = readMetrics(host);
+
+    vector<double> latencies;
+    size_t errors = 0, unavailable = 0, bytes = 0;
+    for (auto const &o : outcomes) {
+        latencies.push_back(o.ms);
+        bytes += o.bytes;
+        if (o.status == 503) unavailable++;
+        if (o.status != 200) errors++;
+    }
+    sort(latencies.begin(),latencies.end());
+
+    cout << requests.size() << " requests in " << seconds << " s: " << requests.size() / seconds << " requests/s, ";
+    cout << errors << " errors (" << unavailable << " busy), latency p50 " << cbbl::percentile(latencies,0.5) << " ms, p95 " << cbbl::percentile(latencies,0.95) << " ms, p99 " << cbbl::percentile(latencies,0.99) << " ms" << endl;
+
+    ostringstream json;
+    json << "{\"host\":\"" << host << "\"";
+    json << ",\"requests\":" << requests.size();
+    json << ",\"concurrency\":" << concurrency;
+    json << ",\"rate\":" << rate;
+    json << ",\"seconds\":" << seconds;
+    json << ",\"requests_per_s\":" << requests.size() / seconds;
+    json << ",\"bytes\":" << bytes;
+    json << ",\"errors\":" << errors;
+    json << ",\"unavailable\":" << unavailable;
+    json << ",\"error_rate\":" << (double)errors / requests.size();
+    json << ",\"latency\":{\"p50_ms\":" << cbbl::percentile(latencies,0.5);
+    json << ",\"p90_ms\":" << cbbl::percentile(latencies,0.9);
+    json << ",\"p95_ms\":" << cbbl::percentile(latencies,0.95);
+    json << ",\"p99_ms\":" << cbbl::percentile(latencies,0.99);
+    json << ",\"max_ms\":" << latencies.back() << "}";
+    // what serve did with the requests, if it exposes /metrics
+    if (!metrics_after.empty()) {
+        json << ",\"server\":{";
+        const char *counters[] = {"cbbl_requests_total","cbbl_coalesced_total","cbbl_renders_total","cbbl_cache_hits_total{cache=\"memory\"}","cbbl_cache_misses_total{cache=\"memory\"}","cbbl_cache_hits_total{cache=\"disk\"}","cbbl_shed_total","cbbl_expired_total"};
+        bool first = true;
+        for (auto name : counters) {
+            if (!metrics_after.count(name)) continue;
+            string key = name;
+            key = regex_replace(key,regex("\\{cache=\"(\\w+)\"\\}"),"_$1");
+            json << (first ? "" : ",") << "\"" << key << "\":" << metrics_after[name] - metrics_before[name];
+            first = false;
+        }
+        json << "}";
+    }
+    json << "}";
+
+    cout << json.str() << endl;
+    if (result.count("output")) {
+        ofstream out(result["output"].as<string>());
+        out << json.str() << endl;
+    }
+}
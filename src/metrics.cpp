@@ -0,0 +1,92 @@
+#include "cbbl/metrics.hpp"
+#include "cbbl/tile.hpp"
+
+using namespace std;
+
+namespace cbbl {
+const array<double,Histogram::BUCKETS> &Histogram::bounds() {
+    static const array<double,BUCKETS> b{{0.1,0.25,0.5,1,2.5,5,10,25,50,100,250,500,1000,2500,5000,10000}};
+    return b;
+}
+
+void Histogram::observe(double ms) {
+    auto const &b = bounds();
+    int i = 0;
+    while (i < BUCKETS && ms > b[i]) i++;
+    mBuckets[i].fetch_add(1,memory_order_relaxed);
+    mCount.fetch_add(1,memory_order_relaxed);
+    mSumMicros.fetch_add((uint64_t)(max(ms,0.0) * 1000),memory_order_relaxed);
+}
+
+double Histogram::quantileMs(double q) const {
+    uint64_t total = mCount;
+    if (total == 0) return 0;
+    auto const &b = bounds();
+    double rank = q * total;
+    uint64_t seen = 0;
+    for (int i = 0; i <= BUCKETS; i++) {
+        uint64_t n = mBuckets[i];
+        if (n > 0 && seen + n >= rank) {
+            // everything slower than the last bound is reported as the last bound
+            if (i == BUCKETS) return b[BUCKETS - 1];
+            double lower = i == 0 ? 0 : b[i - 1];
+            return lower + (b[i] - lower) * (rank - seen) / n;
+        }
+        seen += n;
+    }
+    return b[BUCKETS - 1];
+}
+
+void Histogram::writePrometheus(ostream &out, const string &name, const string &labels) const {
+    auto const &b = bounds();
+    string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        cumulative += mBuckets[i];
+        out << name << "_bucket{" << labels << sep << "le=\"" << b[i] / 1000 << "\"} " << cumulative << "\n";
+    }
+    cumulative += mBuckets[BUCKETS];
+    out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_sum{" << labels << "} " << sumMs() / 1000 << "\n";
+    out << name << "_count{" << labels << "} " << cumulative << "\n";
+}
+
+void Histogram::writeJson(ostream &out) const {
+    uint64_t n = count();
+    out << "{\"count\":" << n;
+    out << ",\"sum_s\":" << sumMs() / 1000;
+    out << ",\"mean_ms\":" << (n ? sumMs() / n : 0);
+    out << ",\"p50_ms\":" << quantileMs(0.5);
+    out << ",\"p95_ms\":" << quantileMs(0.95);
+    out << ",\"p99_ms\":" << quantileMs(0.99) << "}";
+}
+
+void StageMetrics::add(const RenderTiming &timing) {
+    datasource.observe(timing.datasource_ms);
+    setup.observe(timing.setup_ms);
+    render.observe(timing.render_ms);
+    encode.observe(timing.encode_ms);
+}
+
+static const char *STAGE_NAMES[] = {"fetch","decompress","datasource","setup","render","encode","write"};
+
+void StageMetrics::writePrometheus(ostream &out) const {
+    const Histogram *stages[] = {&fetch,&decompress,&datasource,&setup,&render,&encode,&write};
+    out << "# HELP cbbl_stage_seconds Time spent per tile in each stage from source to client.\n";
+    out << "# TYPE cbbl_stage_seconds histogram\n";
+    for (int i = 0; i < 7; i++) {
+        stages[i]->writePrometheus(out,"cbbl_stage_seconds",string("stage=\"") + STAGE_NAMES[i] + "\"");
+    }
+}
+
+void StageMetrics::writeJson(ostream &out) const {
+    const Histogram *stages[] = {&fetch,&decompress,&datasource,&setup,&render,&encode,&write};
+    out << "{";
+    for (int i = 0; i < 7; i++) {
+        if (i > 0) out << ",";
+        out << "\"" << STAGE_NAMES[i] << "\":";
+        stages[i]->writeJson(out);
+    }
+    out << "}";
+}
+}
@@ -0,0 +1,150 @@
+#include "cbbl/scheduler.hpp"
+#include <stdexcept>
+
+using namespace std;
+
+namespace cbbl {
+// the pool and index of the worker running on this thread, if any
+thread_local WorkStealingPool *tPool = nullptr;
+thread_local int tWorker = -1;
+
+WorkStealingPool::WorkStealingPool(int threads) {
+    if (threads <= 0) throw invalid_argument("WorkStealingPool needs at least one thread");
+    for (int i = 0; i < threads; i++) mWorkers.push_back(make_unique<Worker>());
+    for (int i = 0; i < threads; i++) mThreads.emplace_back([this,i] { run(i); });
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    join();
+}
+
+void WorkStealingPool::post(function<void()> task) {
+    mPending++;
+    int index = (tPool == this) ? tWorker : mNext++ % mWorkers.size();
+    {
+        // counted under the deque lock, so a worker can't take the task before it is counted
+        lock_guard<mutex> lock(mWorkers[index]->mutex);
+        mQueued++;
+        mWorkers[index]->tasks.push_back(move(task));
+    }
+    // a worker that saw mQueued == 0 holds mSleepMutex until it waits, so the notify can't come between
+    { lock_guard<mutex> lock(mSleepMutex); }
+    mWake.notify_one();
+}
+
+// own deque from the back (newest), others from the front (oldest)
+bool WorkStealingPool::take(int index, function<void()> &task) {
+    {
+        Worker &own = *mWorkers[index];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+            mQueued--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < mWorkers.size(); i++) {
+        Worker &victim = *mWorkers[(index + i) % mWorkers.size()];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            mQueued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::run(int index) {
+    tPool = this;
+    tWorker = index;
+    function<void()> task;
+    while (true) {
+        if (take(index,task)) {
+            task();
+            task = nullptr;
+            if (--mPending == 0) {
+                lock_guard<mutex> lock(mSleepMutex);
+                mDone.notify_all();
+            }
+            continue;
+        }
+        unique_lock<mutex> lock(mSleepMutex);
+        mWake.wait(lock,[this] { return mQueued > 0 || mStop; });
+        if (mStop && mQueued == 0) return;
+    }
+}
+
+void WorkStealingPool::join() {
+    {
+        unique_lock<mutex> lock(mSleepMutex);
+        mDone.wait(lock,[this] { return mPending == 0; });
+        mStop = true;
+    }
+    mWake.notify_all();
+    for (auto &t : mThreads) {
+        if (t.joinable()) t.join();
+    }
+}
+
+PriorityPool::PriorityPool(int threads) {
+    if (threads <= 0) throw invalid_argument("PriorityPool needs at least one thread");
+    for (int i = 0; i < threads; i++) mThreads.emplace_back([this] { run(); });
+}
+
+PriorityPool::~PriorityPool() {
+    join();
+}
+
+void PriorityPool::post(function<void()> task, int64_t priority) {
+    {
+        lock_guard<mutex> lock(mMutex);
+        mTasks.push(Task{priority,mSequence++,move(task)});
+    }
+    mWake.notify_one();
+}
+
+size_t PriorityPool::queued() {
+    lock_guard<mutex> lock(mMutex);
+    return mTasks.size();
+}
+
+size_t PriorityPool::running() {
+    lock_guard<mutex> lock(mMutex);
+    return mRunning;
+}
+
+void PriorityPool::run() {
+    unique_lock<mutex> lock(mMutex);
+    while (true) {
+        mWake.wait(lock,[this] { return !mTasks.empty() || mStop; });
+        if (mTasks.empty()) return;
+        // top() is const; the task is moved out just before it is popped
+        function<void()> task = move(const_cast<Task &>(mTasks.top()).run);
+        mTasks.pop();
+        mRunning++;
+        lock.unlock();
+        auto begin = chrono::steady_clock::now();
+        task();
+        task = nullptr;
+        mBusyMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+        lock.lock();
+        mRunning--;
+        if (mTasks.empty() && mRunning == 0) mDone.notify_all();
+    }
+}
+
+void PriorityPool::join() {
+    {
+        unique_lock<mutex> lock(mMutex);
+        mDone.wait(lock,[this] { return mTasks.empty() && mRunning == 0; });
+        mStop = true;
+    }
+    mWake.notify_all();
+    for (auto &t : mThreads) {
+        if (t.joinable()) t.join();
+    }
+}
+}
@@ -3,6 +3,7 @@
 #define USE_STANDALONE_ASIO true
 #include "server_http.hpp"
 #include "asio/thread_pool.hpp"
+#include "asio/post.hpp"
 #include "boost/filesystem.hpp"
 #include "mapnik/image_view.hpp"
 #include "mapnik/font_engine_freetype.hpp"
@@ -10,7 +11,12 @@
 
 #include "cbbl/tile.hpp"
 #include "cbbl/source.hpp"
+#include "cbbl/cache.hpp"
+#include "cbbl/hash.hpp"
 #include "cbbl/viewer.hpp"
+#include "cbbl/scheduler.hpp"
+#include "cbbl/metrics.hpp"
+#include "cbbl/inflight.hpp"
 
 using namespace std;
 using HttpServer = SimpleWeb::Server<SimpleWeb::HTTP>;
@@ -24,31 +30,118 @@ public:
     int y;
     int scale;
     int display_level;
+    int version; // style version the metatile is rendered with
 };
 
 std::ostream & operator<<(std::ostream & stream, const Tile & t) {
-    stream << t.z << "/" << t.x << "/" << t.y << "@" << t.scale << "x";
+    stream << t.z << "/" << t.x << "/" << t.y << "@" << t.scale << "x v" << t.version;
     return stream;
 }
 
-struct TileCompare {
-    bool operator() (const Tile& lhs, const Tile &rhs) const {
-        if (lhs.display_level == rhs.display_level) {
-            if (lhs.scale == rhs.scale) {
-                if (lhs.z == rhs.z) {
-                    if (lhs.y == rhs.y) {
-                        return lhs.x < rhs.x;
-                    } else return lhs.y < rhs.y;
-                } else return lhs.z < rhs.z;
-            } else return lhs.scale < rhs.scale;
-        } else return lhs.display_level < rhs.display_level;
-    }
+static int METATILE_LEVEL = 2;
+// deepest display zoom: x and y must fit the 21 bits packTile gives them
+static const int MAX_ZOOM = 21;
+// render pool priority of disk cache lookups: above every render, which is (32 - z) << 40 plus a sequence
+static const int64_t DISK_LOOKUP_PRIORITY = (int64_t)64 << 40;
+
+// a request waiting for its metatile to render
+struct Waiter {
+    Tile tile;
+    shared_ptr<HttpServer::Response> response;
+    shared_ptr<HttpServer::Request> request;
+    chrono::steady_clock::time_point since;
 };
 
-static int METATILE_LEVEL = 2;
+// metatiles being fetched or rendered, with the requests waiting for them
+cbbl::InFlight<Waiter> gMetatiles;
+
+// a metatile is also told apart by the display zoom it is cut into, kept in the bits packTile leaves free
+static cbbl::CacheKey jobKey(const Tile &meta_tile) {
+    return cbbl::CacheKey{cbbl::packTile(meta_tile.z,meta_tile.x,meta_tile.y,meta_tile.scale) | (uint64_t)meta_tile.display_level,meta_tile.version};
+}
+
+static Tile jobTile(const cbbl::CacheKey &key) {
+    const uint64_t mask = (1 << 21) - 1;
+    return Tile{(int)(key.tile >> 59),(int)((key.tile >> 38) & mask),(int)((key.tile >> 17) & mask),(int)((key.tile >> 15) & 3),(int)(key.tile & 0x7fff),key.version};
+}
+
+// request counters for /metrics, next to the stage histograms
+struct ServeCounters {
+    atomic<uint64_t> requests{0};
+    atomic<uint64_t> coalesced{0};      // joined a metatile already queued or rendering
+    atomic<uint64_t> data_coalesced{0}; // joined a data tile already being fetched
+    atomic<uint64_t> shed{0};           // 503 because the queue was full
+    atomic<uint64_t> expired{0};        // 503 after waiting past --queue-timeout
+    atomic<uint64_t> cancelled{0};      // renders skipped because every waiter timed out
+    atomic<uint64_t> errors{0};
+    atomic<uint64_t> renders{0};
+};
+ServeCounters gCounters;
+cbbl::StageMetrics gStages;
 
-mutex gMutex;
-map<Tile,vector<pair<Tile,shared_ptr<HttpServer::Response>>>,TileCompare> mState;
+static void writeUnavailable(const shared_ptr<HttpServer::Response> &response) {
+    response->write(SimpleWeb::StatusCode::server_error_service_unavailable,"Busy",{{"Retry-After","1"}});
+}
+
+// Called when a render thread picks up a metatile. Answers 503 to waiters that have waited longer
+// than timeout; true if nobody is left to render for. A client that disconnected is not noticed
+// here: the server doesn't read a connection while its response is pending.
+static bool abandoned(const Tile &meta_tile, chrono::milliseconds timeout) {
+    vector<Waiter> expired;
+    auto now = chrono::steady_clock::now();
+    bool empty = !gMetatiles.update(jobKey(meta_tile),[&](vector<Waiter> &waiters) {
+        vector<Waiter> live;
+        for (auto &w : waiters) {
+            if (now - w.since > timeout) {
+                expired.push_back(move(w));
+            } else {
+                live.push_back(move(w));
+            }
+        }
+        waiters = move(live);
+    });
+    // expired waiters are answered even if others still wait for the render
+    gCounters.expired += expired.size();
+    for (auto &w : expired) writeUnavailable(w.response);
+    if (empty) gCounters.cancelled++;
+    return empty;
+}
+
+// metatile jobs waiting on a data tile that is being fetched, so each data tile is fetched and decompressed once
+using DataCallback = function<void(shared_ptr<const cbbl::DataTile>,const string &)>;
+cbbl::InFlight<DataCallback> gDataTiles;
+
+static void writeImage(const shared_ptr<HttpServer::Response> &response, const string &buf, const cbbl::Encoder &encoder, bool cors) {
+    SimpleWeb::CaseInsensitiveMultimap headers;
+    if (cors) headers.emplace("Access-Control-Allow-Origin","*");
+    headers.emplace("Content-Type",encoder.contentType());
+    response->write(buf,headers);
+}
+
+static cbbl::CacheKey cacheKey(const Tile &t) {
+    return cbbl::CacheKey{cbbl::packTile(t.z,t.x,t.y,t.scale),t.version};
+}
+
+// identifies the data behind the tiles across restarts: an mbtiles file changes its size,
+// modification time or metadata when it is replaced or updated
+static uint64_t sourceFingerprint(const string &source_str, cbbl::Source &source) {
+    uint64_t h = cbbl::hashBytes(source_str);
+    for (auto const &m : source.metadata()) h = cbbl::hashBytes(m.first + "=" + m.second,h);
+    boost::system::error_code ec;
+    if (boost::filesystem::is_regular_file(source_str,ec)) {
+        auto mtime = boost::filesystem::last_write_time(source_str,ec);
+        auto size = boost::filesystem::file_size(source_str,ec);
+        h = cbbl::hashBytes(to_string(mtime) + "/" + to_string(size),h);
+    }
+    return h;
+}
+
+// metatiles on disk are keyed by source, style fingerprint and image format, since versions restart with the process
+static string diskCachePath(const Tile &meta_tile, const cbbl::Style &style, const cbbl::Encoder &encoder, uint64_t source_fingerprint) {
+    ostringstream ss;
+    ss << cbbl::toHex(cbbl::hashBytes(encoder.format(),cbbl::hashBytes((const char *)&source_fingerprint,8,style.fingerprint()))) << "/" << meta_tile.display_level << "/" << meta_tile.x << "/" << meta_tile.y << "@" << meta_tile.scale << "x.meta";
+    return ss.str();
+}
 
 void cmdServe(int argc, char * argv[]) {
     cxxopts::Options cmd_options("SERVE", "Serve raster tiles");
@@ -60,6 +153,16 @@ void cmdServe(int argc, char * argv[]) {
         ("port", "HTTP port", cxxopts::value<int>())
         ("threads", "Number of rendering threads", cxxopts::value<int>())
         ("map", "directory of map style", cxxopts::value<string>())
+        ("cache-size", "MB of encoded tiles to keep in memory, 0 to disable (default 256)", cxxopts::value<int>())
+        ("data-cache-size", "MB of decompressed source tiles to keep in memory, 0 to disable (default 128)", cxxopts::value<int>())
+        ("disk-cache", "directory to persist rendered metatiles in", cxxopts::value<string>())
+        ("disk-cache-size", "MB of metatiles to keep on disk (default 4096)", cxxopts::value<int>())
+        ("format", "image format: png (default), png8, png8:z=9, jpeg85, webp", cxxopts::value<string>())
+        ("encode-threads", "extra threads helping render threads encode the tiles of @2x/@3x metatiles (default: threads / 4, 0 to disable)", cxxopts::value<int>())
+        ("max-queue", "metatiles waiting to render or for an upstream connection before new ones get 503 (default 256)", cxxopts::value<int>())
+        ("queue-timeout", "ms a request may wait for its render before it gets 503 (default 10000)", cxxopts::value<int>())
+        ("upstream-concurrency", "http source: requests in flight at once (default 32)", cxxopts::value<int>())
+        ("upstream-timeout", "http source: seconds before a request fails (default 10)", cxxopts::value<int>())
       ;
 
     cmd_options.parse_positional({"cmd","source"});
@@ -67,19 +170,72 @@ void cmdServe(int argc, char * argv[]) {
 
     int threads = 4;
     if (result.count("threads")) threads = result["threads"].as<int>();
-    asio::thread_pool pool(threads);
+    if (threads < 1) {
+        cout << "--threads must be at least 1." << endl;
+        exit(1);
+    }
+    // lower zooms first, since they cover the most of the screen; within a zoom the newest request first
+    cbbl::PriorityPool pool(threads);
+    atomic<int64_t> request_sequence{0};
+    size_t max_queue = 256;
+    if (result.count("max-queue")) max_queue = result["max-queue"].as<int>();
+    chrono::milliseconds queue_timeout(10000);
+    if (result.count("queue-timeout")) queue_timeout = chrono::milliseconds(result["queue-timeout"].as<int>());
 
+    size_t cache_mb = 256;
+    if (result.count("cache-size")) cache_mb = result["cache-size"].as<int>();
+    cbbl::TileCache cache(cache_mb * 1024 * 1024);
+
+    // overzoomed metatiles past z16 share one z14 data tile, so it is decompressed once, not per metatile.
+    // fewer shards than the tile cache, so a large z14 tile still fits in one
+    size_t data_cache_mb = 128;
+    if (result.count("data-cache-size")) data_cache_mb = result["data-cache-size"].as<int>();
+    cbbl::DataTileCache data_cache(data_cache_mb * 1024 * 1024,4);
+
+    unique_ptr<cbbl::DiskCache> disk_cache;
+    if (result.count("disk-cache")) {
+        size_t disk_cache_mb = 4096;
+        if (result.count("disk-cache-size")) disk_cache_mb = result["disk-cache-size"].as<int>();
+        try {
+            disk_cache = make_unique<cbbl::DiskCache>(result["disk-cache"].as<string>(),disk_cache_mb * 1024 * 1024);
+        } catch (const exception &e) {
+            cout << "--disk-cache: " << e.what() << endl;
+            exit(1);
+        }
+    }
+
+    cbbl::UniformTiles uniform;
+    cbbl::SolidTiles solid;
+    cbbl::RenderOptions render_options;
+    if (result.count("format")) render_options.encoder = cbbl::Encoder(result["format"].as<string>());
+    render_options.uniform = &uniform;
+    render_options.solid = &solid;
+    render_options.encode_threads = threads / 4;
+    if (result.count("encode-threads")) render_options.encode_threads = result["encode-threads"].as<int>();
+    asio::thread_pool encode_pool(max(render_options.encode_threads,1));
+    if (render_options.encode_threads > 0) render_options.encode_pool = &encode_pool;
+    auto const &encoder = render_options.encoder;
+
+    // one io_context runs both the server and async upstream fetches
+    auto io = make_shared<asio::io_context>();
     HttpServer server;
+    server.io_service = io;
     int port = 8090;
     if (result.count("port")) port = result["port"].as<int>();
     server.config.port = port;
 
     bool cors = result.count("cors");
+    bool verbose = result.count("verbose");
     auto source_str = result["source"].as<string>();
 
-    auto source = cbbl::CreateSource(source_str);
+    cbbl::SourceOptions source_options;
+    source_options.io = io;
+    if (result.count("upstream-concurrency")) source_options.max_in_flight = result["upstream-concurrency"].as<int>();
+    if (result.count("upstream-timeout")) source_options.timeout = result["upstream-timeout"].as<int>();
+    auto source = cbbl::CreateSource(source_str,source_options);
     auto bounds = source->bounds();
     auto center = source->center();
+    uint64_t source_fingerprint = sourceFingerprint(source_str,*source);
 
     mapnik::logger::instance().set_severity(mapnik::logger::none);
 
@@ -92,117 +248,289 @@ void cmdServe(int argc, char * argv[]) {
         mapnik::freetype_engine::register_fonts("/usr/local/lib/mapnik/fonts");
     }
 
+    cbbl::StyleWatcher styles(map_dir);
+    cout << "loaded style " << map_dir << " in " << styles.current()->loadMs() << " ms" << endl;
+    styles.start();
+
     cout << "source: " << source_str << " with " << threads << " threads on port " << port << endl;
 
-    server.resource["^/([0-9]+)/([0-9]+)/([0-9]+)(@([2-3])x)?.png$"]["GET"] = [cors,&pool,source_str,map_dir](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
+    server.resource["^/([0-9]+)/([0-9]+)/([0-9]+)(@([2-3])x)?\\." + encoder.extension() + "$"]["GET"] = [cors,verbose,&pool,&request_sequence,max_queue,queue_timeout,&cache,&data_cache,&disk_cache,&render_options,&encoder,source_str,source_fingerprint,&source,&styles,io](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
         // displaytile, metatile and datatile
         // the URL params are the Display tiles
-        int32_t display_z = stoi(request->path_match[1]);
-        int32_t display_x = stoi(request->path_match[2]);
-        int32_t display_y = stoi(request->path_match[3]);
+        // packTile has room for z21; checked before stoi, which throws on out-of-range numbers
+        auto const &m = request->path_match;
+        if (m[1].length() > 2 || m[2].length() > 7 || m[3].length() > 7) {
+            response->write(SimpleWeb::StatusCode::client_error_not_found,"Tile out of range");
+            return;
+        }
+        int32_t display_z = stoi(m[1]);
+        int32_t display_x = stoi(m[2]);
+        int32_t display_y = stoi(m[3]);
+        if (display_z > MAX_ZOOM || display_x >= (1 << display_z) || display_y >= (1 << display_z)) {
+            response->write(SimpleWeb::StatusCode::client_error_not_found,"Tile out of range");
+            return;
+        }
         int display_scale = 1;
         if (request->path_match[5].length() > 0) {
             display_scale = stoi(request->path_match[5]);
         }
-        Tile display_tile{display_z,display_x,display_y,display_scale,display_z};
+        // pin the style for this request; a reload only affects requests that arrive after it
+        auto style = styles.current();
+        gCounters.requests++;
+        Tile display_tile{display_z,display_x,display_y,display_scale,display_z,style->version()};
+
+        if (auto cached = cache.get(cacheKey(display_tile))) {
+            writeImage(response,*cached,encoder,cors);
+            return;
+        }
 
         Tile meta_tile;
         int metatile_zdiff = 2;
         if (display_z < METATILE_LEVEL) {
             metatile_zdiff = display_z;
-            meta_tile = Tile{0,0,0,display_scale,display_z};
+            meta_tile = Tile{0,0,0,display_scale,display_z,style->version()};
         } else {
-            meta_tile = Tile{display_z-METATILE_LEVEL,display_x/(1 << METATILE_LEVEL),display_y/(1 << METATILE_LEVEL),display_scale,display_z};
+            meta_tile = Tile{display_z-METATILE_LEVEL,display_x/(1 << METATILE_LEVEL),display_y/(1 << METATILE_LEVEL),display_scale,display_z,style->version()};
         }
 
-        {
-            lock_guard<mutex> lock(gMutex);
-            if (mState.count(meta_tile)) {
-                mState[meta_tile].push_back(make_pair(display_tile,response));
+        // joins or starts the render; runs on the io thread, like the upstream fetches it may start
+        auto schedule = [display_tile,display_z,meta_tile,metatile_zdiff,style,response,request,cors,verbose,max_queue,queue_timeout,source_str,source_fingerprint,&pool,&request_sequence,&cache,&data_cache,&disk_cache,&render_options,&encoder,&source]() {
+            auto job_key = jobKey(meta_tile);
+            // shed load instead of queueing renders nobody will wait for; joining a queued render is free.
+            // Fetches queued for an upstream connection are renders waiting too.
+            if (pool.queued() + source->waiting() >= max_queue && !gMetatiles.contains(job_key)) {
+                gCounters.shed++;
+                writeUnavailable(response);
+                return;
+            }
+            if (!gMetatiles.join(job_key,Waiter{display_tile,response,request,chrono::steady_clock::now()})) {
+                gCounters.coalesced++;
             } else {
-                vector<pair<Tile,shared_ptr<HttpServer::Response>>> v;
-                v.emplace_back(display_tile,response);
-                mState.emplace(meta_tile,move(v));
-                asio::post(pool, [meta_tile,source_str,map_dir,cors,metatile_zdiff] {
-                    if (!tSource) tSource = cbbl::CreateSource(source_str);
-                    chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-                    // calculate the datatile for this metatile
-                    int data_z = meta_tile.z;
-                    int data_x = meta_tile.x;
-                    int data_y = meta_tile.y;
-                    if (meta_tile.z > 14) {
-                        data_z = 14;
-                        data_x = data_x / (1 << (meta_tile.z-14));
-                        data_y = data_y / (1 << (meta_tile.z-14));
-                    }
-                    Tile data_tile{data_z,data_x,data_y,meta_tile.scale};
-                    auto tile_data = tSource->fetch(data_z,data_x,data_y);
-                    if(tile_data->ok) {
-                        auto img = cbbl::render(map_dir,meta_tile.z,meta_tile.x,meta_tile.y,meta_tile.scale,tile_data->body,data_tile.z,data_tile.x,data_tile.y,metatile_zdiff); // string might be inefficient
-
-                        chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-                        cout << meta_tile.z << "/" << meta_tile.x << "/" << meta_tile.y <<  "@" << meta_tile.scale << ":" << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " ms" << endl;
-
-                        vector<pair<Tile,shared_ptr<HttpServer::Response>>> responses; 
-                        {
-                            lock_guard<mutex> lock(gMutex);
-                            responses = mState.at(meta_tile);
-                            mState.erase(meta_tile);
+                int64_t priority = ((int64_t)(32 - display_z) << 40) + request_sequence++;
+                // calculate the datatile for this metatile
+                int data_z = meta_tile.z;
+                int data_x = meta_tile.x;
+                int data_y = meta_tile.y;
+                if (meta_tile.z > 14) {
+                    data_z = 14;
+                    data_x = data_x / (1 << (meta_tile.z-14));
+                    data_y = data_y / (1 << (meta_tile.z-14));
+                }
+                Tile data_tile{data_z,data_x,data_y,meta_tile.scale,data_z,meta_tile.version};
+                chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+                auto finish = [meta_tile,begin,style,cors,verbose,metatile_zdiff,queue_timeout,source_fingerprint,&cache,&disk_cache,&render_options,&encoder](shared_ptr<const cbbl::DataTile> data, const string &error) {
+                    if (abandoned(meta_tile,queue_timeout)) return;
+                    if (data) {
+                        cbbl::RenderTiming timing;
+                        auto encoded = cbbl::renderMetatile(*style,*data,meta_tile.z,meta_tile.x,meta_tile.y,meta_tile.scale,metatile_zdiff,render_options,&timing);
+                        gStages.add(timing);
+                        gCounters.renders++;
+
+                        if (verbose) {
+                            chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+                            cout << meta_tile.z << "/" << meta_tile.x << "/" << meta_tile.y <<  "@" << meta_tile.scale << ":" << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() << " ms";
+                            cout << " (datasource " << timing.datasource_ms << " setup " << timing.setup_ms << " render " << timing.render_ms << " encode " << timing.encode_ms << ")" << endl;
+                        }
+
+                        // every display tile of the metatile goes in the cache so neighbouring requests hit it
+                        int n = 1 << metatile_zdiff;
+                        for (int i = 0; i < n; i++) {
+                            for (int j = 0; j < n; j++) {
+                                Tile t{meta_tile.z + metatile_zdiff,meta_tile.x * n + i,meta_tile.y * n + j,meta_tile.scale,meta_tile.display_level,meta_tile.version};
+                                auto &buf = encoded[i * n + j];
+                                cache.put(cacheKey(t),buf,buf->size());
+                            }
                         }
+                        if (disk_cache) disk_cache->put(diskCachePath(meta_tile,*style,encoder,source_fingerprint),encoded);
+
+                        auto responses = gMetatiles.take(jobKey(meta_tile));
 
                         // write display tile responses
+                        auto write_begin = chrono::steady_clock::now();
                         for (auto &resp : responses) {
-                            auto display_tile = get<0>(resp);
-                            size_t scale = display_tile.scale;
-
-                            size_t offset_x = (display_tile.x - meta_tile.x * (1 << metatile_zdiff));
-                            size_t offset_y = (display_tile.y - meta_tile.y * (1 << metatile_zdiff));
-                            mapnik::image_view_rgba8 cropped{256*scale*offset_x,256*scale*offset_y,256*scale,256*scale,img};
-                            auto buf = mapnik::save_to_string(cropped,"png");
-                            SimpleWeb::CaseInsensitiveMultimap headers;
-                            if (cors) headers.emplace("Access-Control-Allow-Origin","*");
-                            headers.emplace("Content-Type","image/png");
-                            get<1>(resp)->write(buf,headers);
+                            int offset_x = resp.tile.x - meta_tile.x * n;
+                            int offset_y = resp.tile.y - meta_tile.y * n;
+                            writeImage(resp.response,*encoded[offset_x * n + offset_y],encoder,cors);
                         }
+                        gStages.write.observe(cbbl::elapsedMs(write_begin));
                     } else {
                         // the tile will not render, meaning we need to evict the entire metatile and resolve all promises
-                        cout << "Error: " << tile_data->error << endl;
-                        vector<pair<Tile,shared_ptr<HttpServer::Response>>> responses; 
-                        {
-                            lock_guard<mutex> lock(gMutex);
-                            responses = mState.at(meta_tile);
-                            mState.erase(meta_tile);
-                        }
+                        cout << "Error: " << error << endl;
+                        gCounters.errors++;
+                        auto responses = gMetatiles.take(jobKey(meta_tile));
                         for (auto &resp : responses) {
-                            get<1>(resp)->write("Error");
+                            resp.response->write("Error");
                         }
                     }
-                });
+                };
+
+                auto data_key = cbbl::CacheKey{cbbl::packTile(data_z,data_x,data_y,0),0};
+                if (auto cached = data_cache.get(data_key)) {
+                    pool.post([finish,cached] { finish(cached,""); },priority);
+                    return;
+                }
+
+                if (!gDataTiles.join(data_key,finish)) {
+                    gCounters.data_coalesced++;
+                    return;
+                }
+
+                auto decode = [data_tile,data_key,priority,&data_cache,&pool](shared_ptr<cbbl::TileData> tile_data) {
+                    shared_ptr<const cbbl::DataTile> data;
+                    if (tile_data->ok) {
+                        gStages.decompress.observe(tile_data->decompress_ms);
+                        data = make_shared<const cbbl::DataTile>(data_tile.z,data_tile.x,data_tile.y,move(tile_data->body));
+                        data_cache.put(data_key,data,data->body.size());
+                    }
+                    auto waiters = gDataTiles.take(data_key);
+                    // this thread renders the first metatile, the rest go back to the pool
+                    string error = tile_data->error;
+                    for (size_t i = 1; i < waiters.size(); i++) {
+                        pool.post([data,error,waiter = move(waiters[i])] { waiter(data,error); },priority);
+                    }
+                    waiters[0](data,error);
+                };
+
+                if (source->async()) {
+                    // the fetch waits on the io_context; a render thread is only taken once the bytes are here
+                    auto fetch_begin = chrono::steady_clock::now();
+                    source->fetchAsync(data_z,data_x,data_y,[&pool,decode,priority,fetch_begin](shared_ptr<cbbl::TileData> tile_data) {
+                        gStages.fetch.observe(cbbl::elapsedMs(fetch_begin) - tile_data->decompress_ms);
+                        pool.post([decode,tile_data] { decode(tile_data); },priority);
+                    });
+                } else {
+                    pool.post([decode,source_str,data_z,data_x,data_y] {
+                        if (!tSource) tSource = cbbl::CreateSource(source_str);
+                        auto fetch_begin = chrono::steady_clock::now();
+                        auto tile_data = tSource->fetch(data_z,data_x,data_y);
+                        gStages.fetch.observe(cbbl::elapsedMs(fetch_begin) - tile_data->decompress_ms);
+                        decode(tile_data);
+                    },priority);
+                }
             }
+        };
+
+        if (!disk_cache) {
+            schedule();
+            return;
         }
+        // a cold disk would stall every connection and fetch on the io thread, so the lookup runs on
+        // a render thread, ahead of renders since it is cheap; a miss comes back here to be scheduled
+        int n = 1 << metatile_zdiff;
+        int index = (display_x - meta_tile.x * n) * n + (display_y - meta_tile.y * n);
+        pool.post([display_tile,meta_tile,style,response,index,cors,source_fingerprint,schedule,io,&cache,&disk_cache,&encoder] {
+            if (auto stored = disk_cache->get(diskCachePath(meta_tile,*style,encoder,source_fingerprint),index)) {
+                cache.put(cacheKey(display_tile),stored,stored->size());
+                writeImage(response,*stored,encoder,cors);
+                return;
+            }
+            asio::post(*io,schedule);
+        },DISK_LOOKUP_PRIORITY + request_sequence++);
     };
 
 
     server.resource["^/queue$"]["GET"] = [](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
         ostringstream ss;
-        {
-            lock_guard<mutex> lock(gMutex);
-            for (auto const &pair : mState) {
-                ss << pair.first;
-                for (auto const &r : pair.second) {
-                    ss << " " << r.first;
-                }
-                ss << endl;
+        gMetatiles.forEach([&ss](const cbbl::CacheKey &key, const vector<Waiter> &waiters) {
+            ss << jobTile(key);
+            for (auto const &r : waiters) {
+                ss << " " << r.tile;
             }
+            ss << endl;
+        });
+        response->write(ss.str());
+    };
+
+    server.resource["^/cache$"]["GET"] = [&cache,&data_cache,&disk_cache,&uniform,&solid](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
+        auto stats = cache.stats();
+        ostringstream ss;
+        ss << "hits " << stats.hits << endl;
+        ss << "misses " << stats.misses << endl;
+        ss << "evictions " << stats.evictions << endl;
+        ss << "entries " << stats.entries << endl;
+        ss << "bytes " << stats.bytes << endl;
+        ss << "max_bytes " << stats.max_bytes << endl;
+        ss << "uniform_skipped " << uniform.skipped << endl;
+        ss << "solid_hits " << solid.hits << endl;
+        ss << "solid_misses " << solid.misses << endl;
+        auto data_stats = data_cache.stats();
+        ss << "data_hits " << data_stats.hits << endl;
+        ss << "data_misses " << data_stats.misses << endl;
+        ss << "data_entries " << data_stats.entries << endl;
+        ss << "data_bytes " << data_stats.bytes << endl;
+        if (disk_cache) {
+            auto disk_stats = disk_cache->stats();
+            ss << "disk_hits " << disk_stats.hits << endl;
+            ss << "disk_misses " << disk_stats.misses << endl;
+            ss << "disk_evictions " << disk_stats.evictions << endl;
+            ss << "disk_entries " << disk_stats.entries << endl;
+            ss << "disk_bytes " << disk_stats.bytes << endl;
+            ss << "disk_max_bytes " << disk_stats.max_bytes << endl;
         }
         response->write(ss.str());
     };
 
-    server.resource["^/$"]["GET"] = [center,bounds](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
-        string page = cbbl::viewer(center,bounds);
+    // prometheus text format
+    server.resource["^/metrics$"]["GET"] = [&pool,&source,&cache,&data_cache,&disk_cache,&uniform,&solid](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
+        ostringstream ss;
+        gStages.writePrometheus(ss);
+
+        auto counter = [&ss](const string &name, const string &help, uint64_t value) {
+            ss << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+        };
+        counter("cbbl_requests_total","Tile requests received.",gCounters.requests);
+        counter("cbbl_coalesced_total","Requests that joined a metatile already queued or rendering.",gCounters.coalesced);
+        counter("cbbl_data_coalesced_total","Metatiles that joined a data tile already being fetched.",gCounters.data_coalesced);
+        counter("cbbl_renders_total","Metatiles rendered.",gCounters.renders);
+        counter("cbbl_render_errors_total","Metatiles that failed because their data tile could not be fetched.",gCounters.errors);
+        counter("cbbl_shed_total","Requests answered 503 because the render queue was full.",gCounters.shed);
+        counter("cbbl_expired_total","Requests answered 503 after waiting longer than the queue timeout.",gCounters.expired);
+        counter("cbbl_cancelled_total","Renders skipped because every waiting client had timed out.",gCounters.cancelled);
+        counter("cbbl_uniform_skipped_total","Renders skipped because the data tile is uniform.",uniform.skipped);
+        counter("cbbl_solid_hits_total","Display tiles of one colour given pre-encoded bytes.",solid.hits);
+        counter("cbbl_solid_misses_total","Display tiles of one colour encoded because their colour and size were new.",solid.misses);
+        auto images = cbbl::imagePoolStats();
+        counter("cbbl_image_allocations_total","Render buffers allocated because the thread had none of the size idle.",images.allocations);
+        counter("cbbl_image_reuses_total","Renders into an idle buffer from the thread's pool.",images.reuses);
+
+        auto cacheStats = [&ss](const string &name, const cbbl::CacheStats &stats) {
+            ss << "cbbl_cache_hits_total{cache=\"" << name << "\"} " << stats.hits << "\n";
+            ss << "cbbl_cache_misses_total{cache=\"" << name << "\"} " << stats.misses << "\n";
+            ss << "cbbl_cache_evictions_total{cache=\"" << name << "\"} " << stats.evictions << "\n";
+            ss << "cbbl_cache_entries{cache=\"" << name << "\"} " << stats.entries << "\n";
+            ss << "cbbl_cache_bytes{cache=\"" << name << "\"} " << stats.bytes << "\n";
+        };
+        ss << "# TYPE cbbl_cache_hits_total counter\n# TYPE cbbl_cache_misses_total counter\n# TYPE cbbl_cache_evictions_total counter\n";
+        ss << "# TYPE cbbl_cache_entries gauge\n# TYPE cbbl_cache_bytes gauge\n";
+        cacheStats("memory",cache.stats());
+        cacheStats("data",data_cache.stats());
+        if (disk_cache) cacheStats("disk",disk_cache->stats());
+
+        size_t metatiles = gMetatiles.size();
+        size_t data_fetches = gDataTiles.size();
+        auto gauge = [&ss](const string &name, const string &help, double value) {
+            ss << "# HELP " << name << " " << help << "\n# TYPE " << name << " gauge\n" << name << " " << value << "\n";
+        };
+        gauge("cbbl_queue_depth","Jobs waiting for a render thread.",pool.queued());
+        gauge("cbbl_metatiles_pending","Metatiles queued, fetching or rendering.",metatiles);
+        gauge("cbbl_data_fetches_pending","Data tiles being fetched.",data_fetches);
+        gauge("cbbl_upstream_waiting","Data tile fetches queued for an upstream connection.",source->waiting());
+        gauge("cbbl_image_pool_bytes","Bytes held by idle render buffers.",images.idle_bytes);
+        gauge("cbbl_workers","Render threads.",pool.threads());
+        gauge("cbbl_workers_busy","Render threads running a job right now.",pool.running());
+        ss << "# HELP cbbl_worker_busy_seconds_total Time render threads spent running jobs; its rate over cbbl_workers is the utilisation.\n";
+        ss << "# TYPE cbbl_worker_busy_seconds_total counter\ncbbl_worker_busy_seconds_total " << pool.busySeconds() << "\n";
+
+        response->write(ss.str(),{{"Content-Type","text/plain; version=0.0.4"}});
+    };
+
+    server.resource["^/$"]["GET"] = [center,bounds,&encoder](shared_ptr<HttpServer::Response> response, shared_ptr<HttpServer::Request> request) {
+        string page = cbbl::viewer(center,bounds,encoder.extension());
         response->write(page);
     };
 
     server.start();
+    io->run();
     pool.join();
 }
\ No newline at end of file
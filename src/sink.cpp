@@ -1,39 +1,117 @@
 #include "boost/filesystem.hpp"
 #include "cbbl/sink.hpp"
+#include "cbbl/hash.hpp"
 #include <sstream>
 #include <iostream>
+#include <chrono>
 
 using namespace std;
 
 namespace cbbl {
-unique_ptr<Sink> CreateSink(const string &s) {
+unique_ptr<Sink> CreateSink(const string &s, const SinkOptions &options) {
     string ending = ".mbtiles";
     if (s.length() >= ending.length()) {
         if (0 == s.compare (s.length() - ending.length(), ending.length(), ending)) {
-            return make_unique<MbtilesSink>(s);
+            return make_unique<MbtilesSink>(s,options);
         }
     }
-    return make_unique<FileSink>(s);
+    return make_unique<FileSink>(s,options);
 }
 
-MbtilesSink::MbtilesSink(const string& s) : mOutput(s) {
+MbtilesSink::MbtilesSink(const string& s, const SinkOptions &options) : mOutput(s), mOptions(options), mQueue(options.queue_size) {
     sqlite3_open(mOutput.c_str(), &mDb);
     char * sErrMsg = 0;
+    // large pages keep most PNGs off overflow chains; WAL with synchronous=NORMAL
+    // makes each chunk commit cheap while keeping committed chunks durable
+    sqlite3_exec(mDb, "PRAGMA page_size = 65536", NULL, NULL, &sErrMsg);
+    sqlite3_exec(mDb, "PRAGMA journal_mode = WAL", NULL, NULL, &sErrMsg);
+    sqlite3_exec(mDb, "PRAGMA synchronous = NORMAL", NULL, NULL, &sErrMsg);
     sqlite3_exec(mDb, "BEGIN TRANSACTION", NULL, NULL, &sErrMsg);
-    sqlite3_exec(mDb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)", NULL, NULL, &sErrMsg);
+    if (mOptions.append) {
+        // keep whichever layout the existing output has; its unique indexes make the inserts below upserts
+        sqlite3_stmt * stmt;
+        sqlite3_prepare_v2(mDb, "SELECT 1 FROM sqlite_master WHERE name = 'images'", -1, &stmt, 0);
+        mOptions.dedup = SQLITE_ROW == sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        // an interrupted run never reached the destructor, so its indexes may be missing
+        if (mOptions.dedup) {
+            ensureIndex("map_index","map","zoom_level, tile_column, tile_row");
+            ensureIndex("images_id","images","tile_id");
+        } else {
+            ensureIndex("tile_index","tiles","zoom_level, tile_column, tile_row");
+        }
+    }
+    sqlite3_exec(mDb, "CREATE TABLE IF NOT EXISTS cbbl_progress (zoom_level integer, tile_column integer, tile_row integer, PRIMARY KEY (zoom_level, tile_column, tile_row)) WITHOUT ROWID", NULL, NULL, &sErrMsg);
+    if (!mOptions.resume) sqlite3_exec(mDb, "DELETE FROM cbbl_progress", NULL, NULL, &sErrMsg);
+    sqlite3_prepare_v2(mDb,  "INSERT OR IGNORE INTO cbbl_progress VALUES (?,?,?)", -1, &mProgressStmt, 0);
+    if (mOptions.dedup) {
+        if (!mOptions.append) {
+            sqlite3_exec(mDb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text)", NULL, NULL, &sErrMsg);
+            sqlite3_exec(mDb, "CREATE TABLE images (tile_data blob, tile_id text)", NULL, NULL, &sErrMsg);
+            sqlite3_exec(mDb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id", NULL, NULL, &sErrMsg);
+        }
+        sqlite3_prepare_v2(mDb,  "INSERT OR REPLACE INTO map VALUES (?,?,?,?)", -1, &mMapStmt, 0);
+        sqlite3_prepare_v2(mDb,  "INSERT OR IGNORE INTO images VALUES (?,?)", -1, &mImageStmt, 0);
+        sqlite3_prepare_v2(mDb,  "DELETE FROM map WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &mDeleteStmt, 0);
+    } else {
+        if (!mOptions.append) {
+            sqlite3_exec(mDb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)", NULL, NULL, &sErrMsg);
+        }
+        sqlite3_prepare_v2(mDb,  "INSERT OR REPLACE INTO tiles VALUES (?,?,?,?)", -1, &mTileStmt, 0);
+        sqlite3_prepare_v2(mDb,  "DELETE FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &mDeleteStmt, 0);
+    }
+    mWriter = thread([this] { writer(); });
 }
 
 MbtilesSink::~MbtilesSink() {
+    mDone = true;
+    mQueue.wake();
+    mWriter.join();
+    sqlite3_finalize(mTileStmt);
+    sqlite3_finalize(mMapStmt);
+    sqlite3_finalize(mImageStmt);
+    sqlite3_finalize(mDeleteStmt);
+    sqlite3_finalize(mProgressStmt);
     char * sErrMsg = 0;
+    if (mOptions.dedup && mOptions.append) {
+        // images whose last map row was replaced or deleted
+        sqlite3_exec(mDb, "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map)", NULL, NULL, &sErrMsg);
+    }
+    // the progress record is only needed to resume an interrupted run
+    if (mFinished) sqlite3_exec(mDb, "DROP TABLE IF EXISTS cbbl_progress", NULL, NULL, &sErrMsg);
     sqlite3_exec(mDb, "END TRANSACTION", NULL, NULL, &sErrMsg);
-    sqlite3_exec(mDb, "CREATE UNIQUE INDEX tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &sErrMsg);
+    if (mOptions.dedup) {
+        sqlite3_exec(mDb, "CREATE UNIQUE INDEX IF NOT EXISTS map_index on map (zoom_level, tile_column, tile_row);", NULL, NULL, &sErrMsg);
+        sqlite3_exec(mDb, "CREATE UNIQUE INDEX IF NOT EXISTS images_id on images (tile_id);", NULL, NULL, &sErrMsg);
+    } else {
+        sqlite3_exec(mDb, "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &sErrMsg);
+    }
+    // leave a single self-contained file behind
+    sqlite3_exec(mDb, "PRAGMA journal_mode = DELETE", NULL, NULL, &sErrMsg);
     sqlite3_close(mDb);
 }
 
+// creates a unique index on an existing table, keeping the last written of any duplicate rows
+void MbtilesSink::ensureIndex(const string &name, const string &table, const string &columns) {
+    sqlite3_stmt * stmt;
+    sqlite3_prepare_v2(mDb, "SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = ?", -1, &stmt, 0);
+    sqlite3_bind_text(stmt,1,name.c_str(),name.size(),SQLITE_STATIC);
+    bool exists = SQLITE_ROW == sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (exists) return;
+    char * sErrMsg = 0;
+    string sql = "DELETE FROM " + table + " WHERE rowid NOT IN (SELECT max(rowid) FROM " + table + " GROUP BY " + columns + ")";
+    sqlite3_exec(mDb, sql.c_str(), NULL, NULL, &sErrMsg);
+    sql = "CREATE UNIQUE INDEX " + name + " on " + table + " (" + columns + ")";
+    sqlite3_exec(mDb, sql.c_str(), NULL, NULL, &sErrMsg);
+}
+
 void MbtilesSink::writeMetadata(const map<string,string> &metadata) {
+    lock_guard<mutex> lock(mDbMutex);
     char * sErrMsg = 0;
     sqlite3_stmt * stmt;
-    sqlite3_exec(mDb, "CREATE TABLE metadata (name text, value text)", NULL, NULL, &sErrMsg);
+    sqlite3_exec(mDb, "CREATE TABLE IF NOT EXISTS metadata (name text, value text)", NULL, NULL, &sErrMsg);
+    sqlite3_exec(mDb, "DELETE FROM metadata", NULL, NULL, &sErrMsg);
     sqlite3_prepare_v2(mDb,  "INSERT INTO metadata VALUES (?,?)", -1, &stmt, 0);
     for (auto const &pair : metadata) {
         sqlite3_bind_text(stmt,1,pair.first.c_str(),pair.first.size(),SQLITE_STATIC);
@@ -45,23 +123,136 @@ void MbtilesSink::writeMetadata(const map<string,string> &metadata) {
     sqlite3_finalize(stmt);
 }
 
-void MbtilesSink::writeTile(int res, int z, int x, int y, const string& buf) {
-    char * sErrMsg = 0;
+void MbtilesSink::writeTile(int res, int z, int x, int y, shared_ptr<const string> buf) {
+    Item item{Op::Write,z,x,y,move(buf),{0,0}};
+    if (mOptions.dedup) {
+        // hashed here so the work is spread over the render threads;
+        // two independently seeded hashes make a collision between distinct images negligible
+        item.id = make_pair(hashBytes(*item.data),hashBytes(*item.data,0x9e3779b97f4a7c15ULL));
+    }
+    mQueue.push(move(item));
+}
+
+void MbtilesSink::deleteTile(int res, int z, int x, int y) {
+    mQueue.push(Item{Op::Delete,z,x,y,nullptr,{0,0}});
+}
+
+void MbtilesSink::finish() {
+    mFinished = true;
+}
+
+void MbtilesSink::writeProgress(int z, int x, int y) {
+    mQueue.push(Item{Op::Progress,z,x,y,nullptr,{0,0}});
+}
+
+vector<tuple<int,int,int>> MbtilesSink::readProgress() {
+    lock_guard<mutex> lock(mDbMutex);
+    vector<tuple<int,int,int>> tiles;
     sqlite3_stmt * stmt;
-    sqlite3_prepare_v2(mDb,  "INSERT INTO tiles VALUES (?,?,?,?)", -1, &stmt, 0);
-    sqlite3_bind_int(stmt,1,z);
-    sqlite3_bind_int(stmt,2,x);
-    sqlite3_bind_int(stmt,3,y);
-    sqlite3_bind_blob(stmt,4,buf.data(),buf.size(),SQLITE_STATIC);
-    sqlite3_step(stmt);
+    sqlite3_prepare_v2(mDb, "SELECT zoom_level, tile_column, tile_row FROM cbbl_progress", -1, &stmt, 0);
+    while (SQLITE_ROW == sqlite3_step(stmt)) {
+        tiles.emplace_back(sqlite3_column_int(stmt,0),sqlite3_column_int(stmt,1),sqlite3_column_int(stmt,2));
+    }
     sqlite3_finalize(stmt);
+    return tiles;
 }
 
-FileSink::FileSink(const string& s) : mOutput(s) {
+void MbtilesSink::writer() {
+    char * sErrMsg = 0;
+    int pending = 0;
+    auto last_commit = chrono::steady_clock::now();
+    Item item;
+    while (mQueue.pop(item,[this] { return mDone.load(); })) {
+        lock_guard<mutex> lock(mDbMutex);
+        insert(item);
+        // a crash loses at most one chunk: everything committed is durable and resumable
+        if (++pending >= mOptions.commit_size || chrono::steady_clock::now() - last_commit > chrono::seconds(mOptions.commit_seconds)) {
+            sqlite3_exec(mDb, "COMMIT", NULL, NULL, &sErrMsg);
+            sqlite3_exec(mDb, "BEGIN TRANSACTION", NULL, NULL, &sErrMsg);
+            pending = 0;
+            last_commit = chrono::steady_clock::now();
+        }
+    }
+}
+
+void MbtilesSink::insert(const Item &item) {
+    if (item.op != Op::Write) {
+        sqlite3_stmt * stmt = item.op == Op::Delete ? mDeleteStmt : mProgressStmt;
+        sqlite3_bind_int(stmt,1,item.z);
+        sqlite3_bind_int(stmt,2,item.x);
+        sqlite3_bind_int(stmt,3,item.y);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        return;
+    }
+
+    if (mOptions.dedup) {
+        string tile_id = toHex(item.id.first) + toHex(item.id.second);
+        // duplicate images never reach SQLite, only their map row does
+        if (mImageIds.insert(item.id).second) {
+            sqlite3_bind_blob(mImageStmt,1,item.data->data(),item.data->size(),SQLITE_STATIC);
+            sqlite3_bind_text(mImageStmt,2,tile_id.c_str(),tile_id.size(),SQLITE_STATIC);
+            sqlite3_step(mImageStmt);
+            sqlite3_clear_bindings(mImageStmt);
+            sqlite3_reset(mImageStmt);
+        }
+        sqlite3_bind_int(mMapStmt,1,item.z);
+        sqlite3_bind_int(mMapStmt,2,item.x);
+        sqlite3_bind_int(mMapStmt,3,item.y);
+        sqlite3_bind_text(mMapStmt,4,tile_id.c_str(),tile_id.size(),SQLITE_STATIC);
+        sqlite3_step(mMapStmt);
+        sqlite3_clear_bindings(mMapStmt);
+        sqlite3_reset(mMapStmt);
+        return;
+    }
+
+    sqlite3_bind_int(mTileStmt,1,item.z);
+    sqlite3_bind_int(mTileStmt,2,item.x);
+    sqlite3_bind_int(mTileStmt,3,item.y);
+    sqlite3_bind_blob(mTileStmt,4,item.data->data(),item.data->size(),SQLITE_STATIC);
+    sqlite3_step(mTileStmt);
+    sqlite3_clear_bindings(mTileStmt);
+    sqlite3_reset(mTileStmt);
+}
+
+FileSink::FileSink(const string& s, const SinkOptions &options) : mOutput(s), mExtension(options.extension) {
     boost::filesystem::create_directory(s);
+    string journal = mOutput + "/.progress";
+    if (options.resume && boost::filesystem::exists(journal)) {
+        // drop a last line left unfinished by a crash: completed, it could name a different tile
+        ifstream in(journal,ios::binary);
+        string contents((istreambuf_iterator<char>(in)),istreambuf_iterator<char>());
+        size_t end = contents.find_last_of('\n');
+        boost::filesystem::resize_file(journal,end == string::npos ? 0 : end + 1);
+    }
+    mJournal.open(journal,options.resume ? ios::app : ios::trunc);
 }
 
-void FileSink::writeTile(int res, int z, int x, int y, const string& buf) {
+void FileSink::finish() {
+    lock_guard<mutex> lock(mJournalMutex);
+    mJournal.close();
+    boost::filesystem::remove(mOutput + "/.progress");
+}
+
+void FileSink::writeProgress(int z, int x, int y) {
+    lock_guard<mutex> lock(mJournalMutex);
+    mJournal << z << "/" << x << "/" << y << "\n";
+    mJournal.flush();
+}
+
+vector<tuple<int,int,int>> FileSink::readProgress() {
+    lock_guard<mutex> lock(mJournalMutex);
+    vector<tuple<int,int,int>> tiles;
+    ifstream in(mOutput + "/.progress");
+    string line;
+    int z, x, y;
+    while (getline(in,line)) {
+        if (sscanf(line.c_str(),"%d/%d/%d",&z,&x,&y) == 3) tiles.emplace_back(z,x,y);
+    }
+    return tiles;
+}
+
+void FileSink::writeTile(int res, int z, int x, int y, shared_ptr<const string> buf) {
     string z_dir = mOutput + "/" + to_string(z);
     string zx_dir = mOutput + "/" + to_string(z) + "/" + to_string(x);
     {
@@ -76,15 +267,23 @@ void FileSink::writeTile(int res, int z, int x, int y, const string& buf) {
         }
     }
     ofstream outfile;
+    outfile.open(tilePath(res,z,x,y));
+    outfile << *buf << endl;
+    outfile.close();
+}
+
+void FileSink::deleteTile(int res, int z, int x, int y) {
+    boost::filesystem::remove(tilePath(res,z,x,y));
+}
+
+string FileSink::tilePath(int res, int z, int x, int y) const {
     stringstream tile_name;
     tile_name << mOutput + "/" + to_string(z) + "/" + to_string(x) + "/" + to_string(y);
     if (res > 1) {
         tile_name << "@" << res << "x";
     }
-    tile_name << ".png";
-    outfile.open(tile_name.str());
-    outfile << buf << endl;
-    outfile.close();
+    tile_name << "." << mExtension;
+    return tile_name.str();
 }
 
 }
\ No newline at end of file
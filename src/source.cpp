@@ -1,36 +1,158 @@
 #include "gzip/decompress.hpp"
 #include "cbbl/source.hpp"
+#include "cbbl/hash.hpp"
+#include "cbbl/metrics.hpp"
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
 
 using namespace std;
 
 namespace cbbl {
-unique_ptr<Source> CreateSource(const string &s) {
+unique_ptr<Source> CreateSource(const string &s, const SourceOptions &options) {
     string ending = ".mbtiles";
     if (s.length() >= ending.length()) {
         if (0 == s.compare (s.length() - ending.length(), ending.length(), ending)) {
             return make_unique<MbtilesSource>(s);
         }
     }
-    return make_unique<HttpSource>(s);
+    return make_unique<HttpSource>(s,options);
 }
 
-HttpSource::HttpSource(const string &tile_url) : client(tile_url) {
+// turns an upstream response into tile data: anything but 200 is an error,
+// and gzip bodies are decompressed whether or not the server says so
+static shared_ptr<TileData> toTileData(const string &status, const SimpleWeb::CaseInsensitiveMultimap &header, string body) {
+    if (status.compare(0,3,"200") != 0) {
+        return make_shared<TileData>("",false,"upstream " + status);
+    }
+    bool gzipped = body.size() >= 2 && (unsigned char)body[0] == 0x1f && (unsigned char)body[1] == 0x8b;
+    auto encoding = header.find("Content-Encoding");
+    if (encoding != header.end() && encoding->second == "gzip") gzipped = true;
+    auto begin = chrono::steady_clock::now();
+    if (gzipped) {
+        try {
+            body = gzip::decompress(body.data(),body.size());
+        } catch (const exception &e) {
+            return make_shared<TileData>("",false,string("bad gzip body: ") + e.what());
+        }
+    }
+    auto data = make_shared<TileData>(move(body),true,"");
+    data->decompress_ms = elapsedMs(begin);
+    return data;
 }
 
-const shared_ptr<TileData> HttpSource::fetch(int z, int x, int y) {
+static string tilePath(int z, int x, int y) {
     ostringstream url_ss;
     url_ss << "/" <<  z << "/" << x << "/" << y << ".pbf";
-    string url = url_ss.str();
-    auto data_response = client.request("GET", url);
-    return make_shared<TileData>(data_response->content.string(),true,"");
+    return url_ss.str();
+}
+
+HttpSource::HttpSource(const string &tile_url, const SourceOptions &options) : client(tile_url), options(options) {
+    client.config.timeout = options.timeout;
+    client.config.timeout_connect = options.connect_timeout;
+    if (options.io) {
+        async_client = make_unique<Client>(tile_url);
+        async_client->io_service = options.io;
+        async_client->config.timeout = options.timeout;
+        async_client->config.timeout_connect = options.connect_timeout;
+    }
+}
+
+const shared_ptr<TileData> HttpSource::fetch(int z, int x, int y) {
+    try {
+        auto data_response = client.request("GET", tilePath(z,x,y), "", {{"Accept-Encoding","gzip"}});
+        return toTileData(data_response->status_code,data_response->header,data_response->content.string());
+    } catch (const SimpleWeb::system_error &e) {
+        return make_shared<TileData>("",false,e.what());
+    }
+}
+
+void HttpSource::fetchAsync(int z, int x, int y, FetchCallback done) {
+    Request request{tilePath(z,x,y),move(done)};
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (in_flight >= options.max_in_flight) {
+            queue.push_back(move(request));
+            return;
+        }
+        in_flight++;
+    }
+    start(move(request));
+}
+
+size_t HttpSource::waiting() {
+    lock_guard<mutex> lock(queue_mutex);
+    return queue.size();
+}
+
+void HttpSource::start(Request request) {
+    auto done = make_shared<FetchCallback>(move(request.done));
+    async_client->request("GET", request.path, "", {{"Accept-Encoding","gzip"}}, [this,done](shared_ptr<Client::Response> response, const SimpleWeb::error_code &ec) {
+        // the callback runs on an io thread, so hand back the bytes and nothing more
+        if (ec) {
+            (*done)(make_shared<TileData>("",false,ec.message()));
+        } else {
+            (*done)(toTileData(response->status_code,response->header,response->content.string()));
+        }
+        finished();
+    });
+}
+
+void HttpSource::finished() {
+    Request next;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (queue.empty()) {
+            in_flight--;
+            return;
+        }
+        next = move(queue.front());
+        queue.pop_front();
+    }
+    start(move(next));
 }
 
 HttpSource::~HttpSource() {
 
 }
 
+// distance along a Hilbert curve of order 14 covering the world, for a tile at any zoom
+static int64_t curvePosition(int z, int x, int y) {
+    if (z <= 14) {
+        x <<= 14 - z;
+        y <<= 14 - z;
+    } else {
+        x >>= z - 14;
+        y >>= z - 14;
+    }
+    int64_t d = 0;
+    for (int s = 1 << 13; s > 0; s >>= 1) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += (int64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x,y);
+        }
+    }
+    return d;
+}
+
+static void curvePositionFunction(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    sqlite3_result_int64(ctx,curvePosition(sqlite3_value_int(argv[0]),sqlite3_value_int(argv[1]),sqlite3_value_int(argv[2])));
+}
+
+void addTileFunctions(sqlite3 *db) {
+    sqlite3_create_function(db, "cbbl_hilbert", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, curvePositionFunction, NULL, NULL);
+}
+
 MbtilesSource::MbtilesSource(const string &path) {
     sqlite3_open_v2(path.c_str(), &db,SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,NULL);
+    addTileFunctions(db);
     sqlite3_prepare_v2(db,  "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?", -1, &stmt, 0);
 }
 
@@ -93,10 +215,14 @@ const shared_ptr<TileData> MbtilesSource::fetch(int z, int x, int y) {
     if (SQLITE_ROW == sqlite3_step(stmt)) {
         const char* res = (char *)sqlite3_column_blob(stmt,0);
         int num_bytes = sqlite3_column_bytes(stmt,0);
+        auto begin = chrono::steady_clock::now();
         string decompressed_data = gzip::decompress(res, num_bytes);
+        double decompress_ms = elapsedMs(begin);
         sqlite3_clear_bindings(stmt);
         sqlite3_reset(stmt);
-        return make_shared<TileData>(move(decompressed_data),true,"");
+        auto data = make_shared<TileData>(move(decompressed_data),true,"");
+        data->decompress_ms = decompress_ms;
+        return data;
     } else {
         sqlite3_clear_bindings(stmt);
         sqlite3_reset(stmt);
@@ -106,7 +232,8 @@ const shared_ptr<TileData> MbtilesSource::fetch(int z, int x, int y) {
 
 const vector<pair<int,int>> MbtilesSource::zoom_count() {
     sqlite3_stmt *count_stmt;
-    sqlite3_prepare_v2(db, "SELECT zoom_level, count(*) FROM tiles GROUP BY zoom_level", -1, &count_stmt, 0);
+    string sql = "SELECT zoom_level, count(*) FROM tiles " + where + " GROUP BY zoom_level";
+    sqlite3_prepare_v2(db, sql.c_str(), -1, &count_stmt, 0);
     vector<pair<int,int>> retval;
     while (SQLITE_ROW == sqlite3_step(count_stmt)) {
         int zoom_level = sqlite3_column_int(count_stmt,0);
@@ -117,13 +244,239 @@ const vector<pair<int,int>> MbtilesSource::zoom_count() {
     return retval;
 }
 
+vector<tuple<int,int,int>> MbtilesSource::sample(int z, int count, uint64_t seed) {
+    // reservoir sampling over the tiles in a fixed order, so the pick doesn't depend on how the file was written
+    string sql = "SELECT tile_column, tile_row FROM tiles " + (where.empty() ? string("WHERE") : where + " AND") + " zoom_level = ? ORDER BY tile_column, tile_row";
+    sqlite3_stmt *sample_stmt;
+    sqlite3_prepare_v2(db, sql.c_str(), -1, &sample_stmt, 0);
+    sqlite3_bind_int(sample_stmt,1,z);
+    mt19937_64 rng(seed * 31 + z);
+    vector<tuple<int,int,int>> picked;
+    uint64_t seen = 0;
+    while (SQLITE_ROW == sqlite3_step(sample_stmt)) {
+        auto t = make_tuple(z,sqlite3_column_int(sample_stmt,0),sqlite3_column_int(sample_stmt,1));
+        if ((int)picked.size() < count) {
+            picked.push_back(t);
+        } else {
+            uint64_t i = rng() % (seen + 1);
+            if (i < (uint64_t)count) picked[i] = t;
+        }
+        seen++;
+    }
+    sqlite3_finalize(sample_stmt);
+    sort(picked.begin(),picked.end());
+    return picked;
+}
+
+int lonToX(double lon, int z) {
+    int x = floor((lon + 180.0) / 360.0 * (1 << z));
+    return min(max(x,0),(1 << z) - 1);
+}
+
+int latToY(double lat, int z) {
+    double r = lat * M_PI / 180.0;
+    int y = floor((1.0 - log(tan(r) + 1.0 / cos(r)) / M_PI) / 2.0 * (1 << z));
+    return min(max(y,0),(1 << z) - 1);
+}
+
+void MbtilesSource::setFilter(const TileFilter &filter) {
+    ostringstream sql;
+    sql << "WHERE zoom_level >= " << filter.minzoom << " AND zoom_level <= " << filter.maxzoom;
+
+    if (filter.bbox.size() == 4) {
+        double lat_max = 85.0511287798;
+        double north = min(filter.bbox[3],lat_max), south = max(filter.bbox[1],-lat_max);
+        sql << " AND (";
+        for (int z = filter.minzoom; z <= filter.maxzoom; z++) {
+            if (z > filter.minzoom) sql << " OR ";
+            sql << "(zoom_level = " << z;
+            sql << " AND tile_column BETWEEN " << lonToX(filter.bbox[0],z) << " AND " << lonToX(filter.bbox[2],z);
+            sql << " AND tile_row BETWEEN " << latToY(north,z) << " AND " << latToY(south,z) << ")";
+        }
+        sql << ")";
+    }
+
+    where = sql.str();
+
+    if (filter.shards > 1) {
+        // weigh the matching tiles into buckets of 256 z14 tiles along the curve,
+        // then cut the curve where the running weight crosses each 1/shards of the total.
+        // Every shard computes the same cuts, so the shards are disjoint and cover everything.
+        const int bucket_shift = 8;
+        vector<double> buckets(1 << (28 - bucket_shift),0.0);
+        sqlite3_stmt * scan_stmt;
+        string scan = "SELECT zoom_level, tile_column, tile_row FROM tiles " + where;
+        sqlite3_prepare_v2(db, scan.c_str(), -1, &scan_stmt, 0);
+        double total = 0;
+        while (SQLITE_ROW == sqlite3_step(scan_stmt)) {
+            int z = sqlite3_column_int(scan_stmt,0);
+            double w = z < (int)filter.zoom_weights.size() ? filter.zoom_weights[z] : 1.0;
+            buckets[curvePosition(z,sqlite3_column_int(scan_stmt,1),sqlite3_column_int(scan_stmt,2)) >> bucket_shift] += w;
+            total += w;
+        }
+        sqlite3_finalize(scan_stmt);
+
+        int64_t lo = buckets.size(), hi = buckets.size();
+        double sum = 0;
+        for (size_t b = 0; b < buckets.size(); b++) {
+            if (lo == (int64_t)buckets.size() && sum >= total * filter.shard / filter.shards) lo = b;
+            if (sum >= total * (filter.shard + 1) / filter.shards && filter.shard + 1 < filter.shards) {
+                hi = b;
+                break;
+            }
+            sum += buckets[b];
+        }
+        where += " AND cbbl_hilbert(zoom_level, tile_column, tile_row) >= " + to_string(lo << bucket_shift);
+        where += " AND cbbl_hilbert(zoom_level, tile_column, tile_row) < " + to_string(hi << bucket_shift);
+    }
+
+    if (!filter.tiles_file.empty()) {
+        vector<tuple<int,int,int>> tiles;
+        ifstream in(filter.tiles_file);
+        string line;
+        int z, x, y;
+        while (getline(in,line)) {
+            if (sscanf(line.c_str(),"%d/%d/%d",&z,&x,&y) == 3) tiles.emplace_back(z,x,y);
+        }
+        restrictTo(tiles);
+    }
+}
+
+// fills temp table `table` with tiles, on first use adding a clause that keeps (or drops) tiles listed there
+static void addTileList(sqlite3 *db, string &where, const string &table, const vector<tuple<int,int,int>> &tiles, bool keep) {
+    char * sErrMsg = 0;
+    string sql = "CREATE TEMP TABLE IF NOT EXISTS " + table + " (zoom_level integer, tile_column integer, tile_row integer, PRIMARY KEY (zoom_level, tile_column, tile_row))";
+    sqlite3_exec(db, sql.c_str(), NULL, NULL, &sErrMsg);
+    sql = "DELETE FROM " + table;
+    sqlite3_exec(db, sql.c_str(), NULL, NULL, &sErrMsg);
+    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &sErrMsg);
+    sqlite3_stmt * insert_stmt;
+    sql = "INSERT OR IGNORE INTO " + table + " VALUES (?,?,?)";
+    sqlite3_prepare_v2(db, sql.c_str(), -1, &insert_stmt, 0);
+    for (auto const &t : tiles) {
+        sqlite3_bind_int(insert_stmt,1,get<0>(t));
+        sqlite3_bind_int(insert_stmt,2,get<1>(t));
+        sqlite3_bind_int(insert_stmt,3,get<2>(t));
+        sqlite3_step(insert_stmt);
+        sqlite3_reset(insert_stmt);
+    }
+    sqlite3_finalize(insert_stmt);
+    sqlite3_exec(db, "COMMIT", NULL, NULL, &sErrMsg);
+    if (where.find(table) == string::npos) {
+        // uncorrelated, so the clause works against any table with tile coordinates
+        where += keep ? " AND (zoom_level, tile_column, tile_row) IN" : " AND (zoom_level, tile_column, tile_row) NOT IN";
+        where += " (SELECT zoom_level, tile_column, tile_row FROM " + table + ")";
+    }
+}
+
+void MbtilesSource::restrictTo(const vector<tuple<int,int,int>> &tiles) {
+    addTileList(db,where,"cbbl_tiles",tiles,true);
+    tile_lists["cbbl_tiles"] = tiles;
+}
+
+void MbtilesSource::exclude(const vector<tuple<int,int,int>> &tiles) {
+    addTileList(db,where,"cbbl_done",tiles,false);
+    tile_lists["cbbl_done"] = tiles;
+}
+
+// runs sql, throwing with SQLite's message if it fails
+static void execOrThrow(sqlite3 *db, const string &sql) {
+    char * sErrMsg = 0;
+    if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &sErrMsg) != SQLITE_OK) {
+        string message = sErrMsg ? sErrMsg : sqlite3_errmsg(db);
+        sqlite3_free(sErrMsg);
+        throw runtime_error(message + " in: " + sql.substr(0,200));
+    }
+}
+
+SourceHashes::SourceHashes(const string &path, const MbtilesSource &source) : region(source.filterSql()) {
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) throw runtime_error("can't open " + path + ": " + sqlite3_errmsg(db));
+    addTileFunctions(db);
+    // temp tables live on the source's connection: the region needs its own copies here
+    for (auto const &list : source.tileLists()) {
+        if (region.find(list.first) == string::npos) continue;
+        string unused;
+        addTileList(db,unused,list.first,list.second,true);
+    }
+    char * sErrMsg = 0;
+    sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS hashes (zoom_level integer, tile_column integer, tile_row integer, hash integer, PRIMARY KEY (zoom_level, tile_column, tile_row)) WITHOUT ROWID", NULL, NULL, &sErrMsg);
+    sqlite3_exec(db, "CREATE TEMP TABLE pending (zoom_level integer, tile_column integer, tile_row integer, hash integer, PRIMARY KEY (zoom_level, tile_column, tile_row)) WITHOUT ROWID", NULL, NULL, &sErrMsg);
+    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, &sErrMsg);
+    sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO pending VALUES (?,?,?,?)", -1, &insert_stmt, 0);
+}
+
+SourceHashes::~SourceHashes() {
+    sqlite3_finalize(insert_stmt);
+    char * sErrMsg = 0;
+    sqlite3_exec(db, "END TRANSACTION", NULL, NULL, &sErrMsg);
+    sqlite3_close(db);
+}
+
+void SourceHashes::add(int z, int x, int y, const protozero::data_view &blob) {
+    sqlite3_bind_int(insert_stmt,1,z);
+    sqlite3_bind_int(insert_stmt,2,x);
+    sqlite3_bind_int(insert_stmt,3,y);
+    sqlite3_bind_int64(insert_stmt,4,(int64_t)hashBytes(blob.data(),blob.size()));
+    sqlite3_step(insert_stmt);
+    sqlite3_reset(insert_stmt);
+}
+
+void SourceHashes::loadPrevious(MbtilesSource &previous) {
+    execOrThrow(db,"DELETE FROM hashes " + region);
+    sqlite3_stmt * stmt;
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO hashes VALUES (?,?,?,?)", -1, &stmt, 0) != SQLITE_OK) throw runtime_error(sqlite3_errmsg(db));
+    MbtilesSource::Iterator iter(previous);
+    while (iter.next()) {
+        sqlite3_bind_int(stmt,1,iter.z);
+        sqlite3_bind_int(stmt,2,iter.x);
+        sqlite3_bind_int(stmt,3,iter.y);
+        sqlite3_bind_int64(stmt,4,(int64_t)hashBytes(iter.blob.data(),iter.blob.size()));
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            string message = sqlite3_errmsg(db);
+            sqlite3_finalize(stmt);
+            throw runtime_error(message);
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+static vector<tuple<int,int,int>> selectTiles(sqlite3 *db, const string &sql) {
+    vector<tuple<int,int,int>> tiles;
+    sqlite3_stmt * stmt;
+    sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0);
+    while (SQLITE_ROW == sqlite3_step(stmt)) {
+        tiles.emplace_back(sqlite3_column_int(stmt,0),sqlite3_column_int(stmt,1),sqlite3_column_int(stmt,2));
+    }
+    sqlite3_finalize(stmt);
+    return tiles;
+}
+
+vector<tuple<int,int,int>> SourceHashes::changed() {
+    return selectTiles(db, "SELECT p.zoom_level, p.tile_column, p.tile_row FROM pending p LEFT JOIN hashes h ON h.zoom_level = p.zoom_level AND h.tile_column = p.tile_column AND h.tile_row = p.tile_row WHERE h.hash IS NULL OR h.hash != p.hash");
+}
+
+vector<tuple<int,int,int>> SourceHashes::removed() {
+    return selectTiles(db, "SELECT zoom_level, tile_column, tile_row FROM hashes " + region + " AND NOT EXISTS (SELECT 1 FROM pending p WHERE p.zoom_level = hashes.zoom_level AND p.tile_column = hashes.tile_column AND p.tile_row = hashes.tile_row)");
+}
+
+void SourceHashes::commit() {
+    execOrThrow(db,"DELETE FROM hashes " + region);
+    execOrThrow(db,"INSERT OR REPLACE INTO hashes SELECT * FROM pending");
+    execOrThrow(db,"DELETE FROM pending");
+    execOrThrow(db,"COMMIT");
+    execOrThrow(db,"BEGIN TRANSACTION");
+}
+
 MbtilesSource::~MbtilesSource() {
     sqlite3_finalize(stmt);
     sqlite3_close(db);
 }
 
 MbtilesSource::Iterator::Iterator(MbtilesSource &src) {
-    sqlite3_prepare_v2(src.db,  "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles", -1, &stmt, 0);
+    string sql = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles " + src.where;
+    sqlite3_prepare_v2(src.db,  sql.c_str(), -1, &stmt, 0);
 }
 
 bool MbtilesSource::Iterator::next() {
@@ -133,7 +486,7 @@ bool MbtilesSource::Iterator::next() {
         y = sqlite3_column_int(stmt,2);
         const char* res = (char *)sqlite3_column_blob(stmt,3);
         int num_bytes = sqlite3_column_bytes(stmt,3);
-        data = gzip::decompress(res,num_bytes);
+        blob = protozero::data_view{res,(size_t)num_bytes};
         return true;
     }
     return false;
@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iterator>
+#include "boost/filesystem.hpp"
+#include "mapnik/load_map.hpp"
+#include "mapnik/well_known_srs.hpp"
+#include "mapnik/font_engine_freetype.hpp"
+#include "mapnik/feature_type_style.hpp"
+#include "mapnik/rule.hpp"
+#include "mapnik/symbolizer.hpp"
+#include "cbbl/style.hpp"
+#include "cbbl/hash.hpp"
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace cbbl {
+static atomic<int> gNextVersion{1};
+// deeper display zooms are never pruned
+static const int MAX_PRUNED_ZOOM = 24;
+
+Style::Style(const string &map_dir) : mDir(map_dir), mMap(256,256,mapnik::MAPNIK_GMERC_PROJ), mVersion(gNextVersion++) {
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+    ifstream xml_in(map_dir + "/map.xml",ios_base::in|ios_base::binary);
+    string xml(istreambuf_iterator<char>(xml_in.rdbuf()),(istreambuf_iterator<char>()));
+    mFingerprint = hashBytes(xml);
+
+    ifstream in(map_dir + "/layers.txt");
+    string line;
+    while (getline(in,line)) {
+        mFingerprint = hashBytes(line,mFingerprint);
+        istringstream iss(line);
+        vector<string> results(istream_iterator<string>{iss},istream_iterator<string>());
+        if (results.size() < 2) continue;
+        mLayers.emplace_back(results[0],results[1]);
+    }
+
+    // swapping a font changes the pixels too; names, sizes and mtimes stand in for the contents
+    boost::system::error_code ec;
+    if (boost::filesystem::is_directory(map_dir + "/fonts",ec)) {
+        vector<string> fonts;
+        for (boost::filesystem::recursive_directory_iterator it(map_dir + "/fonts",ec), end; !ec && it != end; it.increment(ec)) {
+            if (!boost::filesystem::is_regular_file(it->status())) continue;
+            auto const &path = it->path();
+            boost::system::error_code stat_ec;
+            ostringstream entry;
+            entry << path.lexically_relative(map_dir).generic_string() << " " << boost::filesystem::file_size(path,stat_ec) << " " << boost::filesystem::last_write_time(path,stat_ec);
+            fonts.push_back(entry.str());
+        }
+        sort(fonts.begin(),fonts.end());
+        for (auto const &entry : fonts) mFingerprint = hashBytes(entry,mFingerprint);
+    }
+
+    mapnik::load_map_string(mMap,xml,false,map_dir);
+
+    mUniformSafe = mMap.layers().empty() && !mMap.background_image();
+    map<string,bool> fill_only;
+    for (auto const &entry : mLayers) {
+        bool fills = fill_only.count(entry.first) ? fill_only[entry.first] : true;
+        auto style = mMap.find_style(entry.second);
+        if (!style) {
+            fills = false;
+        } else {
+            for (auto const &rule : style->get_rules()) {
+                for (auto const &sym : rule.get_symbolizers()) {
+                    if (!sym.is<mapnik::polygon_symbolizer>()) fills = false;
+                }
+            }
+        }
+        fill_only[entry.first] = fills;
+    }
+    for (auto const &f : fill_only) {
+        if (f.second) mFillOnly.insert(f.first);
+    }
+
+    // Mapnik picks rules by scale denominator, which for 256 px tiles at display zoom z is
+    // 559082264.03 / 2^z whatever the tile scale. A rule within 0.1% of either end of its
+    // range counts as active, so rounding never prunes a layer Mapnik would draw.
+    for (int z = 0; z <= MAX_PRUNED_ZOOM; z++) {
+        double scale_denominator = 559082264.03 / (1 << z);
+        vector<bool> drawn;
+        set<string> reads;
+        for (auto const &entry : mLayers) {
+            bool active = false;
+            auto style = mMap.find_style(entry.second);
+            if (style) {
+                for (auto const &rule : style->get_rules()) {
+                    if (rule.active(scale_denominator * 0.999) || rule.active(scale_denominator * 1.001)) active = true;
+                }
+            }
+            drawn.push_back(active);
+            if (active) reads.insert(entry.first);
+        }
+        mDrawn.push_back(move(drawn));
+        mReads.push_back(move(reads));
+    }
+
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    mLoadMs = chrono::duration_cast<chrono::microseconds>(end - begin).count() / 1000.0;
+}
+
+StyleWatcher::StyleWatcher(const string &map_dir) : mDir(map_dir), mStyle(make_shared<const Style>(map_dir)) {
+}
+
+StyleWatcher::~StyleWatcher() {
+    mStop = true;
+    if (mThread.joinable()) mThread.join();
+}
+
+void StyleWatcher::start() {
+    mThread = thread([this] { watch(); });
+}
+
+void StyleWatcher::reload(bool fonts_changed) {
+    if (fonts_changed && boost::filesystem::exists(mDir + "/fonts")) {
+        mapnik::freetype_engine::register_fonts(mDir + "/fonts");
+    }
+    try {
+        auto style = make_shared<const Style>(mDir);
+        atomic_store(&mStyle,style);
+        cout << "reloaded style " << mDir << " as version " << style->version() << " in " << style->loadMs() << " ms" << endl;
+    } catch (const exception &e) {
+        cout << "style reload failed, keeping version " << current()->version() << ": " << e.what() << endl;
+    }
+}
+
+#ifdef __linux__
+void StyleWatcher::watch() {
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0) {
+        cout << "inotify unavailable, style reload disabled" << endl;
+        return;
+    }
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE;
+    int dir_wd = inotify_add_watch(fd,mDir.c_str(),mask);
+    int fonts_wd = -1;
+    if (boost::filesystem::exists(mDir + "/fonts")) {
+        fonts_wd = inotify_add_watch(fd,(mDir + "/fonts").c_str(),mask);
+    }
+
+    alignas(inotify_event) char buf[4096];
+    bool style_changed = false;
+    bool fonts_changed = false;
+    while (!mStop) {
+        pollfd pfd{fd,POLLIN,0};
+        // editors save in several steps: wait for 200 ms of quiet before recompiling
+        int ready = poll(&pfd,1,(style_changed || fonts_changed) ? 200 : 500);
+        if (ready > 0) {
+            ssize_t len;
+            while ((len = read(fd,buf,sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + len; ) {
+                    auto event = reinterpret_cast<inotify_event *>(p);
+                    string name = event->len ? event->name : "";
+                    if (event->wd == fonts_wd) {
+                        fonts_changed = true;
+                    } else if (event->wd == dir_wd) {
+                        if (name == "map.xml" || name == "layers.txt") style_changed = true;
+                        if (name == "fonts" && fonts_wd < 0) {
+                            fonts_wd = inotify_add_watch(fd,(mDir + "/fonts").c_str(),mask);
+                            fonts_changed = true;
+                        }
+                    }
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+        } else if (ready == 0 && (style_changed || fonts_changed)) {
+            reload(fonts_changed);
+            style_changed = false;
+            fonts_changed = false;
+        }
+    }
+    close(fd);
+}
+#else
+// no inotify: poll modification times once a second
+void StyleWatcher::watch() {
+    auto mtime = [](const string &path) -> time_t {
+        boost::system::error_code ec;
+        auto t = boost::filesystem::last_write_time(path,ec);
+        return ec ? 0 : t;
+    };
+    auto style_mtime = [&] { return max(mtime(mDir + "/map.xml"),mtime(mDir + "/layers.txt")); };
+    time_t last_style = style_mtime();
+    time_t last_fonts = mtime(mDir + "/fonts");
+    while (!mStop) {
+        this_thread::sleep_for(chrono::seconds(1));
+        time_t s = style_mtime();
+        time_t f = mtime(mDir + "/fonts");
+        if (s != last_style || f != last_fonts) {
+            reload(f != last_fonts);
+            last_style = s;
+            last_fonts = f;
+        }
+    }
+}
+#endif
+}
@@ -1,49 +1,738 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
 #include <iostream>
-#include <fstream>
+#include <chrono>
+#include <memory>
+#include <condition_variable>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "asio/thread_pool.hpp"
+#include "asio/post.hpp"
 #include "mapnik/map.hpp"
 #include "mapnik/agg_renderer.hpp"
 #include "mapnik/image_util.hpp"
-#include "mapnik/load_map.hpp"
+#include "mapnik/well_known_srs.hpp"
+#include "mapnik/image_view.hpp"
 #include "vector_tile_datasource_pbf.hpp"
 #include "vector_tile_projection.hpp"
 #include "vector_tile_tile.hpp"
 #include "vtzero/vector_tile.hpp"
+#include "vtzero/geometry.hpp"
+#include "protozero/pbf_reader.hpp"
+#include "protozero/pbf_writer.hpp"
+#include "cbbl/tile.hpp"
 
 namespace cbbl {
-mapnik::image_rgba8 render(const std::string &map_dir, int z, int x, int y, int tile_scale, const protozero::data_view &data, int dz, int dx, int dy, int metatile_zdiff) {
-    int dim = 256 * tile_scale * (1 << metatile_zdiff);
-    mapnik::Map map(dim,dim,mapnik::MAPNIK_GMERC_PROJ);
-    map.set_buffer_size(64 * tile_scale);
+// each render thread keeps its own copy of the style's prototype Map,
+// refreshed only when a different style version is rendered.
+struct ThreadMap {
+    int version = 0;
+    std::unique_ptr<mapnik::Map> map;
+};
+thread_local ThreadMap tMap;
+
+static double msSince(std::chrono::steady_clock::time_point &t) {
+    auto now = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration_cast<std::chrono::microseconds>(now - t).count() / 1000.0;
+    t = now;
+    return ms;
+}
+
+static std::atomic<uint64_t> gImageAllocations{0};
+static std::atomic<uint64_t> gImageReuses{0};
+static std::atomic<int64_t> gImagePoolBytes{0};
+// enough for a metatile, its downsampled scales and a check render
+static const size_t MAX_POOLED_IMAGES = 4;
+
+// the calling thread's idle render buffers
+struct ImagePool {
+    std::vector<std::unique_ptr<mapnik::image_rgba8>> free;
+    ~ImagePool() {
+        for (auto const &img : free) gImagePoolBytes -= img->size();
+    }
+};
+thread_local ImagePool tImagePool;
+
+PooledImage::PooledImage(unsigned width, unsigned height) {
+    auto &free = tImagePool.free;
+    for (auto it = free.begin(); it != free.end(); ++it) {
+        if ((*it)->width() == width && (*it)->height() == height) {
+            mImage = std::move(*it);
+            free.erase(it);
+            gImagePoolBytes -= mImage->size();
+            gImageReuses++;
+            return;
+        }
+    }
+    mImage = std::make_unique<mapnik::image_rgba8>(width,height);
+    gImageAllocations++;
+}
+
+PooledImage::~PooledImage() {
+    auto &free = tImagePool.free;
+    // keep the most recently used sizes: a thread rendering other scales soon has only those pooled
+    if (free.size() >= MAX_POOLED_IMAGES) {
+        gImagePoolBytes -= free.front()->size();
+        free.erase(free.begin());
+    }
+    gImagePoolBytes += mImage->size();
+    free.push_back(std::move(mImage));
+}
+
+ImagePoolStats imagePoolStats() {
+    return ImagePoolStats{gImageAllocations,gImageReuses,(uint64_t)std::max<int64_t>(gImagePoolBytes,0)};
+}
+
+mapnik::image_rgba8 render(const Style &style, int z, int x, int y, int tile_scale, const protozero::data_view &data, int dz, int dx, int dy, int metatile_zdiff, RenderTiming *timing) {
+    mapnik::image_rgba8 buf;
+    render(style,z,x,y,tile_scale,data,dz,dx,dy,metatile_zdiff,buf,timing);
+    return buf;
+}
+
+void render(const Style &style, int z, int x, int y, int tile_scale, const protozero::data_view &data, int dz, int dx, int dy, int metatile_zdiff, mapnik::image_rgba8 &buf, RenderTiming *timing) {
+    auto t = std::chrono::steady_clock::now();
+    RenderTiming phases;
+
     vtzero::vector_tile tile{data};
     std::map<std::string,std::shared_ptr<mapnik::vector_tile_impl::tile_datasource_pbf>> datasources;
+    int display_z = z + metatile_zdiff;
 
+    // layers no rule draws at this zoom are skipped before their features are looked at
     while (auto layer = tile.next_layer()) {
         std::string name{layer.name()};
+        if (!style.reads(name,display_z)) continue;
         protozero::pbf_reader layer_reader(layer.data());
         datasources[name] = std::make_shared<mapnik::vector_tile_impl::tile_datasource_pbf>(layer_reader,dx,dy,dz,false);
     }
+    phases.datasource_ms = msSince(t);
 
-    std::ifstream in(map_dir + "/layers.txt");
-    std::string line;
-    while (std::getline(in,line)) {
-        std::istringstream iss(line);
-        std::vector<std::string> results(std::istream_iterator<std::string>{iss},std::istream_iterator<std::string>());
-        if (results.size() < 2) continue;
-        if (datasources.count(results[0])) {
-            mapnik::layer lyr(results[1],map.srs());
-            lyr.set_datasource(datasources.at(results[0]));
-            lyr.add_style(results[1]);
-            map.add_layer(lyr);
+    if (!tMap.map || tMap.version != style.version()) {
+        tMap.map = std::make_unique<mapnik::Map>(style.map());
+        tMap.version = style.version();
+    }
+    mapnik::Map &map = *tMap.map;
+
+    int dim = 256 * tile_scale * (1 << metatile_zdiff);
+    map.resize(dim,dim);
+    map.set_buffer_size(64 * tile_scale);
+
+    // layers from layers.txt are drawn first, then any layers defined in map.xml itself
+    map.layers().clear();
+    auto const &layers = style.layers();
+    for (size_t i = 0; i < layers.size(); i++) {
+        auto const &entry = layers[i];
+        if (datasources.count(entry.first) && style.drawn(i,display_z)) {
+            mapnik::layer lyr(entry.second,mapnik::MAPNIK_GMERC_PROJ);
+            lyr.set_datasource(datasources.at(entry.first));
+            lyr.add_style(entry.second);
+            map.add_layer(std::move(lyr));
         }
     }
+    for (auto const &lyr : style.map().layers()) {
+        map.add_layer(lyr);
+    }
 
-    mapnik::load_map(map,map_dir + "/map.xml");
     auto bbox = mapnik::vector_tile_impl::tile_mercator_bbox(x,y,z);
     map.zoom_to_box(bbox);
+    phases.setup_ms = msSince(t);
 
-    mapnik::image_rgba8 buf(map.width(),map.height());
+    if (buf.width() != map.width() || buf.height() != map.height()) {
+        buf = mapnik::image_rgba8(map.width(),map.height());
+    } else {
+        // a reused buffer is cleared to transparent, as a new one would be
+        std::memset(buf.data(),0,buf.size());
+        buf.set_premultiplied(false);
+        buf.painted(false);
+    }
     mapnik::agg_renderer<mapnik::image_rgba8> ren(map,buf,tile_scale);
     ren.apply();
+    phases.render_ms = msSince(t);
+
+    // drop datasource references so the tile buffer is not reachable after return
+    map.layers().clear();
+
+    if (timing) *timing += phases;
+}
+
+// collects a polygon to check whether it is a single axis-aligned rectangle
+struct RectangleHandler {
+    int rings = 0;
+    bool outer = true;
+    std::vector<vtzero::point> ring;
+
+    void ring_begin(uint32_t count) {
+        rings++;
+        ring.reserve(count);
+    }
+
+    void ring_point(vtzero::point p) {
+        ring.push_back(p);
+    }
+
+    void ring_end(vtzero::ring_type rt) {
+        if (rt != vtzero::ring_type::outer) outer = false;
+    }
+
+    bool covers(uint32_t extent) const {
+        if (rings != 1 || !outer || ring.size() > 5 || ring.empty()) return false;
+        int32_t min_x = ring[0].x, max_x = ring[0].x, min_y = ring[0].y, max_y = ring[0].y;
+        for (auto const &p : ring) {
+            min_x = std::min(min_x,p.x);
+            max_x = std::max(max_x,p.x);
+            min_y = std::min(min_y,p.y);
+            max_y = std::max(max_y,p.y);
+        }
+        for (auto const &p : ring) {
+            if ((p.x != min_x && p.x != max_x) || (p.y != min_y && p.y != max_y)) return false;
+        }
+        return min_x <= 0 && min_y <= 0 && max_x >= (int32_t)extent && max_y >= (int32_t)extent;
+    }
+};
+
+DataTile::DataTile(int z, int x, int y, std::string b) : z(z), x(x), y(y), body(std::move(b)) {
+    try {
+        vtzero::vector_tile tile{body};
+        int features = 0;
+        while (auto layer = tile.next_layer()) {
+            features += layer.num_features();
+            if (features > 1) return;
+            if (layer.num_features() == 0) continue;
+            auto feature = layer.next_feature();
+            if (feature.geometry_type() != vtzero::GeomType::POLYGON) return;
+            RectangleHandler handler;
+            vtzero::decode_polygon_geometry(feature.geometry(),handler);
+            if (!handler.covers(layer.extent())) return;
+            uniform_layer = std::string(layer.name());
+            uniform_key = uniform_layer;
+            while (auto property = feature.next_property()) {
+                uniform_key += '\0';
+                uniform_key += std::string(property.key());
+                uniform_key += '=';
+                uniform_key += std::string(property.value().data());
+            }
+        }
+        uniform = true;
+    } catch (const std::exception &e) {
+        uniform = false;
+    }
+}
+
+DataTile::~DataTile() {
+}
+
+// deepest quadtree level of FeatureIndex: 128 cells across, the width of a z21 metatile under a z14 tile
+static const int INDEX_LEVELS = 7;
+
+// Every feature of a data tile, kept as its raw protobuf message next to its bounding box.
+// Features are bucketed in a loose quadtree: each one sits in the smallest cell, at most
+// INDEX_LEVELS down, that holds its whole bounding box, so a query visits a few cells per level.
+struct FeatureIndex {
+    struct Feature {
+        protozero::data_view message;
+        int32_t min_x, min_y, max_x, max_y;
+    };
+
+    struct Layer {
+        protozero::data_view name;
+        uint32_t version = 1;
+        uint32_t extent = 4096;
+        std::vector<protozero::data_view> keys;
+        std::vector<protozero::data_view> values;
+        std::vector<Feature> features;
+        // (level << 28 | cell y << 14 | cell x, feature index), sorted
+        std::vector<std::pair<uint32_t,uint32_t>> cells;
+    };
+
+    std::vector<Layer> layers;
+};
+
+struct BoundsHandler {
+    int32_t min_x = INT32_MAX, min_y = INT32_MAX, max_x = INT32_MIN, max_y = INT32_MIN;
+
+    void add(vtzero::point p) {
+        min_x = std::min(min_x,p.x);
+        min_y = std::min(min_y,p.y);
+        max_x = std::max(max_x,p.x);
+        max_y = std::max(max_y,p.y);
+    }
+
+    void points_begin(uint32_t) {}
+    void points_point(vtzero::point p) { add(p); }
+    void points_end() {}
+    void linestring_begin(uint32_t) {}
+    void linestring_point(vtzero::point p) { add(p); }
+    void linestring_end() {}
+    void ring_begin(uint32_t) {}
+    void ring_point(vtzero::point p) { add(p); }
+    void ring_end(vtzero::ring_type) {}
+};
+
+// cell of coordinate v at level, clamped to the tile so buffered geometry lands in an edge cell
+static uint32_t indexCell(int32_t v, int level, uint32_t extent) {
+    int64_t c = (int64_t)v * (1 << level) / (int64_t)extent;
+    return (uint32_t)std::min(std::max(c,(int64_t)0),(int64_t)(1 << level) - 1);
+}
+
+static uint32_t cellKey(int level, uint32_t cx, uint32_t cy) {
+    return (uint32_t)level << 28 | cy << 14 | cx;
+}
+
+static FeatureIndex::Layer indexLayer(protozero::data_view data) {
+    FeatureIndex::Layer layer;
+    protozero::pbf_reader reader(data);
+    while (reader.next()) {
+        switch (reader.tag()) {
+            case 15: layer.version = reader.get_uint32(); break;
+            case 1: layer.name = reader.get_view(); break;
+            case 2: layer.features.push_back(FeatureIndex::Feature{reader.get_view(),0,0,0,0}); break;
+            case 3: layer.keys.push_back(reader.get_view()); break;
+            case 4: layer.values.push_back(reader.get_view()); break;
+            case 5: layer.extent = reader.get_uint32(); break;
+            default: reader.skip();
+        }
+    }
+    if (layer.extent == 0) layer.extent = 4096;
+
+    for (uint32_t i = 0; i < layer.features.size(); i++) {
+        auto &f = layer.features[i];
+        BoundsHandler bounds;
+        try {
+            protozero::pbf_reader feature(f.message);
+            vtzero::GeomType type = vtzero::GeomType::UNKNOWN;
+            protozero::data_view geometry;
+            while (feature.next()) {
+                if (feature.tag() == 3) {
+                    type = static_cast<vtzero::GeomType>(feature.get_enum());
+                } else if (feature.tag() == 4) {
+                    geometry = feature.get_view();
+                } else {
+                    feature.skip();
+                }
+            }
+            vtzero::decode_geometry(vtzero::geometry{geometry,type},bounds);
+        } catch (const std::exception &e) {
+            bounds = BoundsHandler();
+        }
+        if (bounds.min_x > bounds.max_x) {
+            // unreadable or empty geometry: keep it everywhere, as the full tile would
+            bounds.min_x = bounds.min_y = INT32_MIN;
+            bounds.max_x = bounds.max_y = INT32_MAX;
+        }
+        f.min_x = bounds.min_x;
+        f.min_y = bounds.min_y;
+        f.max_x = bounds.max_x;
+        f.max_y = bounds.max_y;
+
+        int level = 0;
+        while (level < INDEX_LEVELS &&
+               indexCell(f.min_x,level + 1,layer.extent) == indexCell(f.max_x,level + 1,layer.extent) &&
+               indexCell(f.min_y,level + 1,layer.extent) == indexCell(f.max_y,level + 1,layer.extent)) {
+            level++;
+        }
+        layer.cells.emplace_back(cellKey(level,indexCell(f.min_x,level,layer.extent),indexCell(f.min_y,level,layer.extent)),i);
+    }
+    std::sort(layer.cells.begin(),layer.cells.end());
+    return layer;
+}
+
+std::string DataTile::clip(int cz, int cx, int cy, double margin) const {
+    std::call_once(mIndexOnce,[this] {
+        mIndex = std::make_unique<FeatureIndex>();
+        protozero::pbf_reader tile(body);
+        while (tile.next(3)) mIndex->layers.push_back(indexLayer(tile.get_view()));
+    });
+
+    std::string out;
+    protozero::pbf_writer tile_writer(out);
+    int d = cz - z;
+    for (auto const &layer : mIndex->layers) {
+        // the clip box in this layer's coordinates
+        double size = (double)layer.extent / (1 << d);
+        int32_t min_x = (int32_t)std::floor((cx - ((int64_t)x << d) - margin) * size) - 1;
+        int32_t min_y = (int32_t)std::floor((cy - ((int64_t)y << d) - margin) * size) - 1;
+        int32_t max_x = (int32_t)std::ceil((cx - ((int64_t)x << d) + 1 + margin) * size) + 1;
+        int32_t max_y = (int32_t)std::ceil((cy - ((int64_t)y << d) + 1 + margin) * size) + 1;
+
+        std::vector<uint32_t> hits;
+        for (int level = 0; level <= INDEX_LEVELS; level++) {
+            uint32_t x0 = indexCell(min_x,level,layer.extent), x1 = indexCell(max_x,level,layer.extent);
+            uint32_t y0 = indexCell(min_y,level,layer.extent), y1 = indexCell(max_y,level,layer.extent);
+            for (uint32_t row = y0; row <= y1; row++) {
+                auto it = std::lower_bound(layer.cells.begin(),layer.cells.end(),std::make_pair(cellKey(level,x0,row),(uint32_t)0));
+                for (; it != layer.cells.end() && it->first <= cellKey(level,x1,row); ++it) {
+                    auto const &f = layer.features[it->second];
+                    if (f.max_x >= min_x && f.min_x <= max_x && f.max_y >= min_y && f.min_y <= max_y) hits.push_back(it->second);
+                }
+            }
+        }
+        if (hits.empty()) continue;
+        // features are drawn in the order they are stored
+        std::sort(hits.begin(),hits.end());
+
+        protozero::pbf_writer layer_writer(tile_writer,3);
+        layer_writer.add_uint32(15,layer.version);
+        layer_writer.add_bytes(1,layer.name.data(),layer.name.size());
+        for (auto i : hits) layer_writer.add_message(2,layer.features[i].message.data(),layer.features[i].message.size());
+        for (auto const &k : layer.keys) layer_writer.add_bytes(3,k.data(),k.size());
+        for (auto const &v : layer.values) layer_writer.add_message(4,v.data(),v.size());
+        layer_writer.add_uint32(5,layer.extent);
+    }
+    return out;
+}
+
+bool UniformTiles::find(const std::string &key, std::shared_ptr<const std::string> &buf) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mTiles.find(key);
+    if (it == mTiles.end()) return false;
+    buf = it->second;
+    return true;
+}
+
+void UniformTiles::insert(const std::string &key, std::shared_ptr<const std::string> buf) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTiles[key] = std::move(buf);
+}
+
+// true if the n pixels at p all equal color; four SSE2 compares per 16 pixels
+static bool pixelsEqual(const uint32_t *p, size_t n, uint32_t color) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i c = _mm_set1_epi32(color);
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)),c);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 4)),c);
+        __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 8)),c);
+        __m128i e = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 12)),c);
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a,b),_mm_and_si128(d,e))) != 0xffff) return false;
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] != color) return false;
+    }
+    return true;
+}
+
+bool solidColor(const mapnik::image_rgba8 &img, unsigned x0, unsigned y0, unsigned width, unsigned height, uint32_t &color) {
+    if (width == 0 || height == 0) return false;
+    color = img.get_row(y0)[x0];
+    for (unsigned y = y0; y < y0 + height; y++) {
+        if (!pixelsEqual(img.get_row(y) + x0,width,color)) return false;
+    }
+    return true;
+}
+
+bool isUniform(const mapnik::image_rgba8 &img) {
+    uint32_t color;
+    return img.size() == 0 || solidColor(img,0,0,img.width(),img.height(),color);
+}
+
+std::shared_ptr<const std::string> SolidTiles::get(uint32_t color, const mapnik::image_view_rgba8 &img, const Encoder &encoder) {
+    uint64_t key = (uint64_t)color << 32 | img.width() << 16 | img.height();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mTiles.find(key);
+        if (it != mTiles.end()) {
+            hits++;
+            return it->second;
+        }
+    }
+    // two threads may both encode a new colour; either result is the same bytes
+    misses++;
+    auto buf = std::make_shared<const std::string>(encoder.encode(img));
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mTiles.size() < MAX_SOLID_TILES) mTiles.emplace(key,buf);
     return buf;
 }
-}
\ No newline at end of file
+
+// encodes the n x n display tiles of img; helpers from the pool pick crops
+// off a shared counter alongside the calling thread
+// shared with the encode pool helpers of one metatile, which may only start once it is done
+struct EncodeState {
+    std::atomic<int> next{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+    int finished = 0;
+};
+
+static void encodeTiles(const mapnik::image_rgba8 &img, int n, int tile_scale, const RenderOptions &options, std::vector<std::shared_ptr<const std::string>> &encoded) {
+    unsigned size = 256 * tile_scale;
+    int count = n * n;
+    auto state = std::make_shared<EncodeState>();
+    // img, options and encoded are only touched for a claimed crop, and the caller waits for every
+    // claimed crop; a helper that starts after the last crop is claimed returns without using them
+    auto work = [state,count,size,n,&img,&options,&encoded] {
+        int k;
+        int done = 0;
+        while ((k = state->next++) < count) {
+            int i = k / n;
+            int j = k % n;
+            mapnik::image_view_rgba8 cropped{size*i,size*j,size,size,img};
+            uint32_t color;
+            if (options.solid && solidColor(img,size*i,size*j,size,size,color)) {
+                encoded[k] = options.solid->get(color,cropped,options.encoder);
+            } else {
+                encoded[k] = std::make_shared<const std::string>(options.encoder.encode(cropped));
+            }
+            done++;
+        }
+        if (done == 0) return;
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->finished += done;
+        if (state->finished == count) state->cv.notify_one();
+    };
+
+    int helpers = 0;
+    if (options.encode_pool && tile_scale > 1 && n > 1) helpers = std::min(options.encode_threads,count - 1);
+    for (int h = 0; h < helpers; h++) asio::post(*options.encode_pool,work);
+    work();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock,[&] { return state->finished == count; });
+}
+
+// sRGB to linear light in 12 bits, and back
+static const std::array<uint16_t,256> &linearTable() {
+    static const std::array<uint16_t,256> table = [] {
+        std::array<uint16_t,256> t;
+        for (int i = 0; i < 256; i++) {
+            double c = i / 255.0;
+            double l = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055,2.4);
+            t[i] = (uint16_t)std::lround(l * 4095);
+        }
+        return t;
+    }();
+    return table;
+}
+
+static const std::array<uint8_t,4096> &srgbTable() {
+    static const std::array<uint8_t,4096> table = [] {
+        std::array<uint8_t,4096> t;
+        for (int i = 0; i < 4096; i++) {
+            double l = i / 4095.0;
+            double c = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l,1 / 2.4) - 0.055;
+            t[i] = (uint8_t)std::lround(c * 255);
+        }
+        return t;
+    }();
+    return table;
+}
+
+// premultiplied value v at alpha a, indexed a * 256 + v, back to straight colour
+static const std::array<uint8_t,65536> &unpremultiplyTable() {
+    static const std::array<uint8_t,65536> table = [] {
+        std::array<uint8_t,65536> t;
+        for (uint32_t a = 0; a < 256; a++) {
+            for (uint32_t v = 0; v < 256; v++) {
+                t[a * 256 + v] = a > 0 && a < 255 ? std::min(255u,(v * 255 + a / 2) / a) : v;
+            }
+        }
+        return t;
+    }();
+    return table;
+}
+
+void downsample(const mapnik::image_rgba8 &img, int factor, mapnik::image_rgba8 &out) {
+    unsigned width = img.width() / factor;
+    unsigned height = img.height() / factor;
+    if (out.width() != width || out.height() != height) out = mapnik::image_rgba8(width,height);
+    bool premultiplied = img.get_premultiplied();
+    out.set_premultiplied(premultiplied);
+    auto const &linear = linearTable();
+    auto const &srgb = srgbTable();
+    auto const &unpremultiply = unpremultiplyTable();
+    uint32_t k = factor * factor;
+
+    // one source row as alpha-weighted linear r, g, b and alpha, then those summed down the factor rows
+    unsigned n = width * factor * 4;
+    std::vector<uint32_t> weighted(n);
+    std::vector<uint32_t> columns(n);
+    for (unsigned oy = 0; oy < height; oy++) {
+        std::fill(columns.begin(),columns.end(),0);
+        for (int r = 0; r < factor; r++) {
+            const uint8_t *row = reinterpret_cast<const uint8_t *>(img.get_row(oy * factor + r));
+            // the table lookups are per pixel gathers; they stay out of the summing loop below
+            if (premultiplied) {
+                for (unsigned i = 0; i < n; i += 4) {
+                    uint32_t a = row[i + 3];
+                    for (int c = 0; c < 3; c++) weighted[i + c] = linear[unpremultiply[a * 256 + row[i + c]]] * a;
+                    weighted[i + 3] = a;
+                }
+            } else {
+                for (unsigned i = 0; i < n; i += 4) {
+                    uint32_t a = row[i + 3];
+                    for (int c = 0; c < 3; c++) weighted[i + c] = linear[row[i + c]] * a;
+                    weighted[i + 3] = a;
+                }
+            }
+            for (unsigned i = 0; i < n; i++) columns[i] += weighted[i];
+        }
+        uint8_t *dst = reinterpret_cast<uint8_t *>(out.get_row(oy));
+        for (unsigned ox = 0; ox < width; ox++) {
+            // this output pixel's factor columns: alpha-weighted linear r, g, b, then summed alpha
+            const uint32_t *col = &columns[4 * ox * factor];
+            uint32_t s[4] = {0,0,0,0};
+            for (int i = 0; i < 4 * factor; i++) s[i % 4] += col[i];
+            uint32_t alpha = s[3];
+            uint32_t a = (alpha + k / 2) / k;
+            for (int c = 0; c < 3; c++) {
+                uint32_t v = alpha ? srgb[(s[c] + alpha / 2) / alpha] : 0;
+                if (premultiplied) v = (v * a + 127) / 255;
+                dst[4 * ox + c] = v;
+            }
+            dst[4 * ox + 3] = a;
+        }
+    }
+}
+
+void ImageDiff::add(const mapnik::image_rgba8 &expected, const mapnik::image_rgba8 &actual) {
+    images++;
+    if (expected.width() != actual.width() || expected.height() != actual.height()) return;
+    const uint8_t *a = expected.bytes();
+    const uint8_t *b = actual.bytes();
+    size_t n = expected.width() * expected.height() * 4;
+    for (size_t i = 0; i < n; i++) {
+        int d = std::abs((int)a[i] - (int)b[i]);
+        sum_abs += d;
+        sum_sq += d * d;
+        max_abs = std::max(max_abs,d);
+    }
+    channels += n;
+}
+
+ImageDiff &ImageDiff::operator+=(const ImageDiff &o) {
+    images += o.images;
+    channels += o.channels;
+    sum_abs += o.sum_abs;
+    sum_sq += o.sum_sq;
+    max_abs = std::max(max_abs,o.max_abs);
+    return *this;
+}
+
+double ImageDiff::psnr() const {
+    if (channels == 0 || sum_sq == 0) return INFINITY;
+    return 10 * std::log10(255.0 * 255.0 / (sum_sq / channels));
+}
+
+// where a metatile can share the encoded tile of other uniform data tiles that draw the same
+struct UniformSlot {
+    bool skippable = false;
+    std::string key;
+};
+
+static UniformSlot uniformSlot(const Style &style, const DataTile &data, int z, int tile_scale, int metatile_zdiff, const RenderOptions &options) {
+    UniformSlot slot;
+    slot.skippable = options.uniform && data.uniform && style.uniformSafe() && (data.uniform_layer.empty() || style.fillOnly(data.uniform_layer));
+    if (slot.skippable) slot.key = std::to_string(style.version()) + "/" + std::to_string(z + metatile_zdiff) + "@" + std::to_string(tile_scale) + "/" + data.uniform_key;
+    return slot;
+}
+
+// fills encoded from the uniform cache and returns true if the slot has a tile there
+static bool uniformHit(UniformSlot &slot, const RenderOptions &options, std::vector<std::shared_ptr<const std::string>> &encoded) {
+    if (!slot.skippable) return false;
+    std::shared_ptr<const std::string> buf;
+    if (options.uniform->find(slot.key,buf)) {
+        if (buf) {
+            options.uniform->skipped++;
+            std::fill(encoded.begin(),encoded.end(),buf);
+            return true;
+        }
+        slot.skippable = false;
+    }
+    return false;
+}
+
+static void encodeMetatile(const mapnik::image_rgba8 &img, const UniformSlot &slot, int n, int tile_scale, const RenderOptions &options, std::vector<std::shared_ptr<const std::string>> &encoded, RenderTiming *timing) {
+    auto t = std::chrono::steady_clock::now();
+    if (slot.skippable) {
+        uint32_t color;
+        if (solidColor(img,0,0,img.width(),img.height(),color)) {
+            mapnik::image_view_rgba8 cropped{0,0,(unsigned)(256*tile_scale),(unsigned)(256*tile_scale),img};
+            auto buf = options.solid ? options.solid->get(color,cropped,options.encoder) : std::make_shared<const std::string>(options.encoder.encode(cropped));
+            options.uniform->insert(slot.key,buf);
+            std::fill(encoded.begin(),encoded.end(),buf);
+            if (timing) timing->encode_ms += msSince(t);
+            return;
+        }
+        options.uniform->insert(slot.key,nullptr);
+    }
+
+    encodeTiles(img,n,tile_scale,options,encoded);
+    if (timing) timing->encode_ms += msSince(t);
+}
+
+// a metatile past the data tile's zoom covers a fraction of it: render only the features near it.
+// The margin is render()'s buffer of 64 px per 256 px display tile.
+static void renderData(const Style &style, const DataTile &data, int z, int x, int y, int tile_scale, int metatile_zdiff, mapnik::image_rgba8 &img, RenderTiming *timing) {
+    std::string clipped;
+    if (z > data.z) {
+        auto clip_begin = std::chrono::steady_clock::now();
+        clipped = data.clip(z,x,y,64.0 / (256 << metatile_zdiff));
+        if (timing) timing->datasource_ms += msSince(clip_begin);
+    }
+    render(style,z,x,y,tile_scale,z > data.z ? protozero::data_view{clipped} : protozero::data_view{data.body},data.z,data.x,data.y,metatile_zdiff,img,timing);
+}
+
+static unsigned metatileSize(int tile_scale, int metatile_zdiff) {
+    return 256 * tile_scale * (1 << metatile_zdiff);
+}
+
+std::vector<std::shared_ptr<const std::string>> renderMetatile(const Style &style, const DataTile &data, int z, int x, int y, int tile_scale, int metatile_zdiff, const RenderOptions &options, RenderTiming *timing) {
+    int n = 1 << metatile_zdiff;
+    std::vector<std::shared_ptr<const std::string>> encoded(n * n);
+    auto slot = uniformSlot(style,data,z,tile_scale,metatile_zdiff,options);
+    if (uniformHit(slot,options,encoded)) return encoded;
+
+    unsigned size = metatileSize(tile_scale,metatile_zdiff);
+    PooledImage img(size,size);
+    renderData(style,data,z,x,y,tile_scale,metatile_zdiff,*img,timing);
+    encodeMetatile(*img,slot,n,tile_scale,options,encoded,timing);
+    return encoded;
+}
+
+std::vector<std::vector<std::shared_ptr<const std::string>>> renderMetatileScales(const Style &style, const DataTile &data, int z, int x, int y, const std::vector<int> &tile_scales, int metatile_zdiff, const RenderOptions &options, RenderTiming *timing, ImageDiff *diff) {
+    int n = 1 << metatile_zdiff;
+    int top = *std::max_element(tile_scales.begin(),tile_scales.end());
+    std::vector<std::vector<std::shared_ptr<const std::string>>> encoded(tile_scales.size(),std::vector<std::shared_ptr<const std::string>>(n * n));
+    std::vector<UniformSlot> slots;
+    std::vector<bool> done;
+    bool need_top = false;
+    for (size_t i = 0; i < tile_scales.size(); i++) {
+        slots.push_back(uniformSlot(style,data,z,tile_scales[i],metatile_zdiff,options));
+        done.push_back(uniformHit(slots[i],options,encoded[i]));
+        if (!done[i] && top % tile_scales[i] == 0) need_top = true;
+    }
+
+    std::unique_ptr<PooledImage> top_img;
+    if (need_top) {
+        unsigned size = metatileSize(top,metatile_zdiff);
+        top_img = std::make_unique<PooledImage>(size,size);
+        renderData(style,data,z,x,y,top,metatile_zdiff,**top_img,timing);
+    }
+    for (size_t i = 0; i < tile_scales.size(); i++) {
+        if (done[i]) continue;
+        int scale = tile_scales[i];
+        unsigned size = metatileSize(scale,metatile_zdiff);
+        if (scale == top) {
+            encodeMetatile(**top_img,slots[i],n,scale,options,encoded[i],timing);
+        } else if (top % scale == 0) {
+            auto t = std::chrono::steady_clock::now();
+            PooledImage img(size,size);
+            downsample(**top_img,top / scale,*img);
+            if (timing) timing->render_ms += msSince(t);
+            encodeMetatile(*img,slots[i],n,scale,options,encoded[i],timing);
+            if (diff) {
+                PooledImage truth(size,size);
+                renderData(style,data,z,x,y,scale,metatile_zdiff,*truth,nullptr);
+                diff->add(*truth,*img);
+            }
+        } else {
+            PooledImage img(size,size);
+            renderData(style,data,z,x,y,scale,metatile_zdiff,*img,timing);
+            encodeMetatile(*img,slots[i],n,scale,options,encoded[i],timing);
+        }
+    }
+    return encoded;
+}
+}